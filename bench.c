@@ -0,0 +1,326 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Microbenchmarks for dtray's hot paths. Run with: make bench && ./bench
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dispatch.h"
+#include "icon.h"
+
+#define LENGTH(X) (sizeof(X) / sizeof((X)[0]))
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Keep the optimizer from discarding results */
+static volatile long sink;
+
+/* The message mix a watcher sees: mostly signals it does not care about,
+ * property polls, and the odd registration. */
+static const struct {
+	int type; /* 0 method, 1 signal */
+	const char *iface;
+	const char *member;
+} msgs[] = {
+	{ 1, DBUS_IFACE, "NameOwnerChanged" },
+	{ 1, DBUS_IFACE, "NameAcquired" },
+	{ 1, ITEM_IFACE, "NewIcon" },
+	{ 1, ITEM_IFACE, "NewStatus" },
+	{ 1, ITEM_IFACE, "NewTitle" },
+	{ 1, ITEM_IFACE, "NewToolTip" },
+	{ 1, DBUSMENU_IFACE, "LayoutUpdated" },
+	{ 1, DBUSMENU_IFACE, "ItemsPropertiesUpdated" },
+	{ 1, "org.freedesktop.Notifications", "NotificationClosed" },
+	{ 0, PROP_IFACE, "Get" },
+	{ 0, PROP_IFACE, "GetAll" },
+	{ 0, WATCHER_IFACE, "RegisterStatusNotifierItem" },
+	{ 0, NULL, "RegisterStatusNotifierItem" },
+	{ 0, INTROSPECT_IFACE, "Introspect" },
+	{ 0, NULL, "Get" },
+	{ 0, "org.freedesktop.DBus.Peer", "Ping" },
+};
+
+/* The strcmp chains dispatch replaced, for comparison */
+static int
+chain_method(const char *iface, const char *member)
+{
+	if (iface && strcmp(iface, WATCHER_IFACE) == 0) {
+		if (strcmp(member, "RegisterStatusNotifierItem") == 0)
+			return MethodRegisterItem;
+		if (strcmp(member, "RegisterStatusNotifierHost") == 0)
+			return MethodRegisterHost;
+		return -1;
+	}
+	if (iface && strcmp(iface, PROP_IFACE) == 0) {
+		if (strcmp(member, "Get") == 0)
+			return MethodGet;
+		if (strcmp(member, "GetAll") == 0)
+			return MethodGetAll;
+		return -1;
+	}
+	if (iface && strcmp(iface, INTROSPECT_IFACE) == 0 && strcmp(member, "Introspect") == 0)
+		return MethodIntrospect;
+	if (!iface && member) {
+		if (strcmp(member, "RegisterStatusNotifierItem") == 0)
+			return MethodRegisterItem;
+		if (strcmp(member, "RegisterStatusNotifierHost") == 0)
+			return MethodRegisterHost;
+		if (strcmp(member, "Get") == 0)
+			return MethodGet;
+		if (strcmp(member, "GetAll") == 0)
+			return MethodGetAll;
+		if (strcmp(member, "Introspect") == 0)
+			return MethodIntrospect;
+	}
+	return -1;
+}
+
+static int
+chain_signal(const char *iface, const char *member)
+{
+	if (iface && strcmp(iface, DBUS_IFACE) == 0 && strcmp(member, "NameOwnerChanged") == 0)
+		return SignalNameOwnerChanged;
+	if (iface && strcmp(iface, DBUSMENU_IFACE) == 0) {
+		if (strcmp(member, "LayoutUpdated") == 0)
+			return SignalLayoutUpdated;
+		if (strcmp(member, "ItemsPropertiesUpdated") == 0)
+			return SignalItemsPropertiesUpdated;
+	}
+	if (iface && strcmp(iface, ITEM_IFACE) == 0) {
+		if (strcmp(member, "NewIcon") == 0)
+			return SignalNewIcon;
+		if (strcmp(member, "NewStatus") == 0)
+			return SignalNewStatus;
+		if (strcmp(member, "NewTitle") == 0)
+			return SignalNewTitle;
+	}
+	return -1;
+}
+
+static void
+bench_dispatch(void)
+{
+	const long n = 2000000;
+	double t, best[2];
+	long i, acc;
+	int j, r;
+
+	/* Both must agree before their timings mean anything */
+	for (j = 0; j < (int)LENGTH(msgs); j++) {
+		if ((msgs[j].type ? dispatch_signal(msgs[j].iface, msgs[j].member) :
+		    dispatch_method(msgs[j].iface, msgs[j].member)) !=
+		    (msgs[j].type ? chain_signal(msgs[j].iface, msgs[j].member) :
+		    chain_method(msgs[j].iface, msgs[j].member))) {
+			fprintf(stderr, "bench: dispatch mismatch for %s\n", msgs[j].member);
+			exit(1);
+		}
+	}
+
+	for (r = 0, best[0] = best[1] = 1e9; r < 5; r++) {
+		t = now();
+		for (i = 0, j = 0, acc = 0; i < n; i++, j = j + 1 < (int)LENGTH(msgs) ? j + 1 : 0)
+			acc += msgs[j].type ? dispatch_signal(msgs[j].iface, msgs[j].member) :
+				dispatch_method(msgs[j].iface, msgs[j].member);
+		sink = acc;
+		if ((t = now() - t) < best[0])
+			best[0] = t;
+
+		t = now();
+		for (i = 0, j = 0, acc = 0; i < n; i++, j = j + 1 < (int)LENGTH(msgs) ? j + 1 : 0)
+			acc += msgs[j].type ? chain_signal(msgs[j].iface, msgs[j].member) :
+				chain_method(msgs[j].iface, msgs[j].member);
+		sink = acc;
+		if ((t = now() - t) < best[1])
+			best[1] = t;
+	}
+	printf("dispatch: table %8.1f ns/msg\n", best[0] * 1e9 / n);
+	printf("dispatch: chain %8.1f ns/msg\n", best[1] * 1e9 / n);
+}
+
+static void
+bench_convert(void)
+{
+	const int w = 512, h = 512, reps = 20;
+	uint32_t *src;
+	unsigned char *dst, *ref;
+	double t, best;
+	Format f;
+	Convert fn;
+	int i, k, r;
+
+	src = malloc((size_t)w * h * sizeof(*src));
+	dst = malloc((size_t)w * h * 4);
+	ref = malloc((size_t)w * h * 4);
+	if (!src || !dst || !ref)
+		exit(1);
+	/* Premultiplied test pattern covering the alpha range */
+	for (i = 0; i < w * h; i++) {
+		uint32_t a = i % 256, c = (i / 7) % 256;
+		src[i] = a << 24 | (c * a / 255) << 16 | ((255 - c) * a / 255) << 8 | (i % 13 * 19 * a / 255);
+	}
+
+	for (k = 0; k < icon_nkernels; k++) {
+		memset(&f, 0, sizeof(f));
+		f.rmask = icon_kernels[k].rmask;
+		f.gmask = icon_kernels[k].gmask;
+		f.bmask = icon_kernels[k].bmask;
+		f.bpp = icon_kernels[k].bpp;
+		f.msb = icon_kernels[k].msb;
+		if (!f.bpp) {
+			/* Exercise the fallback with packed 24-bit */
+			f.rmask = 0xff0000;
+			f.gmask = 0x00ff00;
+			f.bmask = 0x0000ff;
+			f.bpp = 24;
+		}
+		if (!(fn = icon_converter(&f)) || fn != icon_kernels[k].fn) {
+			fprintf(stderr, "bench: %s not selected for its layout\n", icon_kernels[k].name);
+			exit(1);
+		}
+		/* Specialized kernels must match the generic path exactly */
+		icon_kernels[icon_nkernels - 1].fn(&f, ref, src, (size_t)w * h, 0x222222);
+		fn(&f, dst, src, (size_t)w * h, 0x222222);
+		if (memcmp(ref, dst, (size_t)w * h * f.bpp / 8) != 0) {
+			fprintf(stderr, "bench: %s disagrees with generic\n", icon_kernels[k].name);
+			exit(1);
+		}
+
+		for (r = 0, best = 1e9; r < reps; r++) {
+			t = now();
+			fn(&f, dst, src, (size_t)w * h, 0x222222);
+			if ((t = now() - t) < best)
+				best = t;
+		}
+		sink = dst[w * h / 2];
+		printf("convert: %-16s %8.1f Mpx/s\n", icon_kernels[k].name, w * h / best / 1e6);
+	}
+	free(src);
+	free(dst);
+	free(ref);
+}
+
+/* Each entry is one opaque colour, its index, so the decoded pixels
+ * tell which entry was chosen; the order of entries must not matter */
+static void
+check_decode(void)
+{
+	static const struct {
+		int n, max, want;
+		int w[3], h[3]; /* h 0 for a square entry */
+	} sets[] = {
+		{ 2, 128, 256, { 256, 512 }, { 0 } },
+		{ 2, 128, 256, { 512, 256 }, { 0 } },
+		{ 3, 128, 256, { 512, 256, 1024 }, { 0 } },
+		{ 3, 128, 256, { 1024, 512, 256 }, { 0 } },
+		{ 3, 128, 64, { 16, 256, 64 }, { 0 } },
+		{ 3, 128, 64, { 256, 64, 512 }, { 0 } },
+		{ 2, 128, 128, { 512, 128 }, { 0 } },
+		/* A tall entry fits by its height, not its width */
+		{ 2, 64, 48, { 64, 48 }, { 256, 0 } },
+		{ 2, 64, 128, { 96, 128 }, { 512, 0 } },
+	};
+	IconEntry e[3];
+	unsigned char *data[3];
+	Image img;
+	size_t j;
+	int s, i, got;
+
+	for (s = 0; s < (int)LENGTH(sets); s++) {
+		for (i = 0; i < sets[s].n; i++) {
+			e[i].w = sets[s].w[i];
+			e[i].h = sets[s].h[i] ? sets[s].h[i] : e[i].w;
+			e[i].len = (size_t)e[i].w * e[i].h * 4;
+			if (!(data[i] = malloc(e[i].len)))
+				exit(1);
+			for (j = 0; j < e[i].len; j += 4) {
+				data[i][j] = 0xff;
+				data[i][j + 1] = data[i][j + 2] = 0;
+				data[i][j + 3] = i + 1;
+			}
+			e[i].data = data[i];
+		}
+		if (!icon_decode(&img, e, sets[s].n, sets[s].max)) {
+			fprintf(stderr, "bench: decode failed for set %d\n", s);
+			exit(1);
+		}
+		got = sets[s].w[(img.px[0] & 0xff) - 1];
+		if (got != sets[s].want) {
+			fprintf(stderr, "bench: decode chose %d over %d for max %d (set %d)\n",
+				got, sets[s].want, sets[s].max, s);
+			exit(1);
+		}
+		icon_free(&img);
+		for (i = 0; i < sets[s].n; i++)
+			free(data[i]);
+	}
+}
+
+/* Decode, select and scale IconPixmap sets as apps send them: every
+ * common size up to 512x512, the largest ones dominating the cost. */
+static void
+bench_decode(void)
+{
+	static const int sizes[] = { 16, 22, 24, 32, 48, 64, 128, 256, 512 };
+	static const int maxes[] = { 64, 128, 512 };
+	IconEntry e[LENGTH(sizes)];
+	unsigned char *data[LENGTH(sizes)];
+	Image img, scaled;
+	double t, px;
+	int i, j, m, reps = 50;
+
+	for (i = 0; i < (int)LENGTH(sizes); i++) {
+		e[i].w = e[i].h = sizes[i];
+		e[i].len = (size_t)sizes[i] * sizes[i] * 4;
+		if (!(data[i] = malloc(e[i].len)))
+			exit(1);
+		for (j = 0; j < (int)e[i].len; j++)
+			data[i][j] = j % 4 == 0 ? j % 251 : j % 199;
+		e[i].data = data[i];
+	}
+
+	for (m = 0; m < (int)LENGTH(maxes); m++) {
+		/* Source megapixels decoded per second, scaling included */
+		px = 0;
+		t = now();
+		for (i = 0; i < reps; i++) {
+			if (!icon_decode(&img, e, LENGTH(sizes), maxes[m]) ||
+			    !icon_scale(&scaled, &img, 22))
+				exit(1);
+			px += (double)img.w * img.h;
+			sink = scaled.px[0];
+			icon_free(&scaled);
+			icon_free(&img);
+		}
+		t = now() - t;
+		printf("decode: max %3d %8.1f us/set %8.1f Mpx/s\n", maxes[m],
+			t * 1e6 / reps, px / t / 1e6);
+	}
+
+	for (i = 0; i < (int)LENGTH(sizes); i++)
+		free(data[i]);
+}
+
+int
+main(void)
+{
+	if (!dispatch_valid()) {
+		fprintf(stderr, "bench: dispatch tables are inconsistent\n");
+		return 1;
+	}
+	check_decode();
+	bench_dispatch();
+	bench_convert();
+	bench_decode();
+	return 0;
+}
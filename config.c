@@ -0,0 +1,200 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * The only place config.h is included, so every file sees the same
+ * settings through cfg. An optional file of "key = value" lines can
+ * override them at startup and again on SIGHUP.
+ */
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#include "config.h"
+#include "icon.h"
+#include "dtray.h"
+
+#define LENGTH(X) (sizeof(X) / sizeof((X)[0]))
+
+typedef struct {
+	const char *name;
+	size_t off;
+	int str;
+	int min;  /* lowest accepted value of an int; a string with 0 may
+	           * be empty, which unsets it */
+} Key;
+
+/* shmpath, shmicons and turning lagheartbeat on only take effect on
+ * startup; an empty shmpath turns the export off */
+static const Key keys[] = {
+	{ "iconsize", offsetof(Config, iconsize), 0, 1 },
+	{ "iconpadding", offsetof(Config, iconpadding), 0, 0 },
+	{ "iconsrcmax", offsetof(Config, iconsrcmax), 0, 1 },
+	{ "bgcolor", offsetof(Config, bgcolor), 1, 1 },
+	{ "scrollinterval", offsetof(Config, scrollinterval), 0, 0 },
+	{ "timeoutmin", offsetof(Config, timeoutmin), 0, 1 },
+	{ "timeoutmax", offsetof(Config, timeoutmax), 0, 1 },
+	{ "timeoutfactor", offsetof(Config, timeoutfactor), 0, 1 },
+	{ "breakerfailures", offsetof(Config, breakerfailures), 0, 1 },
+	{ "breakeropen", offsetof(Config, breakeropen), 0, 1 },
+	{ "breakeropenmax", offsetof(Config, breakeropenmax), 0, 1 },
+	{ "menufont", offsetof(Config, menufont), 1, 1 },
+	{ "menufg", offsetof(Config, menufg), 1, 1 },
+	{ "menubg", offsetof(Config, menubg), 1, 1 },
+	{ "menuselfg", offsetof(Config, menuselfg), 1, 1 },
+	{ "menuselbg", offsetof(Config, menuselbg), 1, 1 },
+	{ "menudisfg", offsetof(Config, menudisfg), 1, 1 },
+	{ "shmpath", offsetof(Config, shmpath), 1, 0 },
+	{ "shmicons", offsetof(Config, shmicons), 0, 0 },
+	{ "outqmax", offsetof(Config, outqmax), 0, 1 },
+	{ "destmax", offsetof(Config, destmax), 0, 0 },
+	{ "destcalls", offsetof(Config, destcalls), 0, 1 },
+	{ "lagthreshold", offsetof(Config, lagthreshold), 0, 0 },
+	{ "lagheartbeat", offsetof(Config, lagheartbeat), 0, 0 },
+};
+
+Config cfg;
+static char *strs[LENGTH(keys)]; /* strings cfg points to from the file */
+
+static void
+defaults(Config *c)
+{
+	c->iconsize = iconsize;
+	c->iconpadding = iconpadding;
+	c->iconsrcmax = iconsrcmax;
+	c->bgcolor = bgcolor;
+	c->scrollinterval = scrollinterval;
+	c->timeoutmin = timeoutmin;
+	c->timeoutmax = timeoutmax;
+	c->timeoutfactor = timeoutfactor;
+	c->breakerfailures = breakerfailures;
+	c->breakeropen = breakeropen;
+	c->breakeropenmax = breakeropenmax;
+	c->menufont = menufont;
+	c->menufg = menufg;
+	c->menubg = menubg;
+	c->menuselfg = menuselfg;
+	c->menuselbg = menuselbg;
+	c->menudisfg = menudisfg;
+	c->shmpath = shmpath;
+	c->shmicons = shmicons;
+	c->outqmax = outqmax;
+	c->destmax = destmax;
+	c->destcalls = destcalls;
+	c->lagthreshold = lagthreshold;
+	c->lagheartbeat = lagheartbeat;
+}
+
+void
+config_init(void)
+{
+	defaults(&cfg);
+}
+
+static char *
+trim(char *s)
+{
+	char *e;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	for (e = s + strlen(s); e > s && isspace((unsigned char)e[-1]); e--)
+		;
+	*e = '\0';
+	return s;
+}
+
+/* Set one key of c; new strings go to newstrs */
+static int
+set(Config *c, char **newstrs, const char *name, char *val)
+{
+	char *end;
+	size_t i, n;
+	long l;
+
+	for (i = 0; i < LENGTH(keys) && strcmp(keys[i].name, name); i++)
+		;
+	if (i == LENGTH(keys))
+		return 0;
+
+	if (keys[i].str) {
+		n = strlen(val);
+		if (n >= 2 && val[0] == '"' && val[n - 1] == '"') {
+			val[n - 1] = '\0';
+			val++;
+		}
+		if (!*val) {
+			if (keys[i].min)
+				return 0;
+			*(const char **)((char *)c + keys[i].off) = NULL;
+			return 1;
+		}
+		free(newstrs[i]);
+		if (!(newstrs[i] = strdup(val)))
+			return 0;
+		*(const char **)((char *)c + keys[i].off) = newstrs[i];
+		return 1;
+	}
+
+	l = strtol(val, &end, 10);
+	if (end == val || *end || l < keys[i].min || l > 1 << 20)
+		return 0;
+	*(int *)((char *)c + keys[i].off) = l;
+	return 1;
+}
+
+/* Returns what is wrong with a whole configuration, or NULL */
+static const char *
+check(const Config *c)
+{
+	if (c->timeoutmin > c->timeoutmax)
+		return "timeoutmin is above timeoutmax";
+	if (c->breakeropen > c->breakeropenmax)
+		return "breakeropen is above breakeropenmax";
+	return NULL;
+}
+
+/* Rebuild cfg from config.h and the file at path. Bad lines are reported
+ * and skipped. Returns 0 and changes nothing if the file cannot be read,
+ * or -1 if its settings contradict each other. */
+int
+config_load(const char *path)
+{
+	Config c;
+	char *newstrs[LENGTH(keys)] = { NULL };
+	char line[256], *key, *val;
+	const char *err;
+	FILE *fp;
+	size_t i;
+	int n = 0;
+
+	if (!(fp = fopen(path, "r")))
+		return 0;
+	defaults(&c);
+	while (fgets(line, sizeof(line), fp)) {
+		n++;
+		key = trim(line);
+		if (!*key || *key == '#')
+			continue;
+		if (!(val = strchr(key, '=')) ||
+		    (*val++ = '\0', !set(&c, newstrs, trim(key), trim(val))))
+			fprintf(stderr, "dtray: %s:%d: bad setting\n", path, n);
+	}
+	fclose(fp);
+
+	if ((err = check(&c))) {
+		fprintf(stderr, "dtray: %s: %s, keeping settings\n", path, err);
+		for (i = 0; i < LENGTH(keys); i++)
+			free(newstrs[i]);
+		return -1;
+	}
+	cfg = c;
+	for (i = 0; i < LENGTH(keys); i++) {
+		free(strs[i]);
+		strs[i] = newstrs[i];
+	}
+	return 1;
+}
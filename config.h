@@ -1,10 +1,58 @@
 /* See LICENSE file for copyright and license details. */
 
-/* icon size in pixels */
+/* icon size in pixels, until the tray resizes the icon window */
 static const int iconsize = 22;
 
-/* icon padding */
+/* largest icon kept per item for rescaling without refetching */
+static const int iconsrcmax = 128;
+
+/* space in pixels kept between the icon and its window edge */
 static const int iconpadding = 2;
 
 /* background color (used when icon has transparency) */
 static const char *bgcolor = "#222222";
+
+/* minimum interval in ms between coalesced Scroll calls to an item */
+static const int scrollinterval = 30;
+
+/* timeout bounds in ms for calls to items; within them the timeout is
+ * timeoutfactor times the item's observed reply latency */
+static const int timeoutmin = 100;
+static const int timeoutmax = 1000;
+static const int timeoutfactor = 4;
+
+/* consecutive failures before calls to an item are suspended, and the
+ * initial and maximum suspension in ms (doubled on each failed probe) */
+static const int breakerfailures = 3;
+static const int breakeropen = 5000;
+static const int breakeropenmax = 120000;
+
+/* context menu font (an XLFD pattern list for a UTF-8 capable fontset)
+ * and colors */
+static const char *menufont = "fixed";
+static const char *menufg = "#bbbbbb";
+static const char *menubg = "#222222";
+static const char *menuselfg = "#eeeeee";
+static const char *menuselbg = "#005577";
+static const char *menudisfg = "#555555";
+
+/* state snapshot for status bars and scripts (see shm.h), NULL (or
+ * empty in the config file) to disable; a relative name is taken in
+ * $XDG_RUNTIME_DIR. shmicons also exports each item's pixels, which
+ * makes dtray fetch them for items no tray shows, and maps a few MB */
+static const char *shmpath = "dtray";
+static const int shmicons = 0;
+
+/* calls to an app that may go unanswered before further ones are
+ * deferred; unsent bytes libdbus may hold, i.e. how far behind our own
+ * bus connection may fall, before all sends are; and bytes that may be
+ * deferred per peer before its sends are dropped */
+static const int destcalls = 4;
+static const int outqmax = 256 * 1024;
+static const int destmax = 64 * 1024;
+
+/* a loop wakeup taking longer than lagthreshold ms is logged with the
+ * operation that took most of it, 0 to disable; with lagheartbeat set a
+ * thread also checks every lagheartbeat ms for a loop that is stuck */
+static const int lagthreshold = 100;
+static const int lagheartbeat = 0;
@@ -7,12 +7,18 @@ MANPREFIX = ${PREFIX}/share/man
 
 # includes and libs
 INCS = -I/usr/include/dbus-1.0 -I/usr/lib/dbus-1.0/include
-LIBS = -lX11 -ldbus-1
+LIBS = -lX11 -ldbus-1 -lpthread
 
 # flags
 CPPFLAGS = -D_DEFAULT_SOURCE -DVERSION=\"${VERSION}\"
 CFLAGS   = -std=c99 -pedantic -Wall -Os ${INCS} ${CPPFLAGS}
+# icon.c's pixel kernels are written for the vectorizer, which -Os keeps off
+KERNELFLAGS = -O3
 LDFLAGS  = ${LIBS}
 
 # compiler
 CC = cc
+
+# fuzzing (make fuzz), needs clang with libFuzzer
+FUZZCC = clang
+FUZZFLAGS = -std=c99 -g -O1 -fsanitize=fuzzer,address,undefined ${CPPFLAGS}
@@ -0,0 +1,172 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Table-driven dispatch of D-Bus messages. Each table gets a small hash
+ * index on the member's length and end bytes, built on first use, so a
+ * lookup compares strings only for the entries in one probe run and the
+ * interface only once the member matches. Handlers then index by the
+ * returned id instead of comparing names again, so a new method or
+ * signal is a table entry.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "dispatch.h"
+
+#define LENGTH(X) (sizeof(X) / sizeof((X)[0]))
+#define INDEX 32 /* slots per index, a power of two well above a table */
+
+typedef struct {
+	const Entry *tab;
+	size_t n;
+	int built;
+	unsigned char slot[INDEX]; /* entry + 1, 0 if empty */
+	unsigned char len[INDEX];  /* its member's length */
+} Index;
+
+static const Entry methods[] = {
+	{ WATCHER_IFACE, "RegisterStatusNotifierItem", MethodRegisterItem },
+	{ WATCHER_IFACE, "RegisterStatusNotifierHost", MethodRegisterHost },
+	{ PROP_IFACE, "Get", MethodGet },
+	{ PROP_IFACE, "GetAll", MethodGetAll },
+	{ INTROSPECT_IFACE, "Introspect", MethodIntrospect },
+};
+
+static const Entry signals[] = {
+	{ DBUS_IFACE, "NameOwnerChanged", SignalNameOwnerChanged },
+	{ ITEM_IFACE, "NewIcon", SignalNewIcon },
+	{ ITEM_IFACE, "NewStatus", SignalNewStatus },
+	{ ITEM_IFACE, "NewTitle", SignalNewTitle },
+	{ DBUSMENU_IFACE, "LayoutUpdated", SignalLayoutUpdated },
+	{ DBUSMENU_IFACE, "ItemsPropertiesUpdated", SignalItemsPropertiesUpdated },
+};
+
+static const Entry props[] = {
+	{ WATCHER_IFACE, "IsStatusNotifierHostRegistered", PropHostRegistered },
+	{ WATCHER_IFACE, "ProtocolVersion", PropProtocolVersion },
+	{ WATCHER_IFACE, "RegisteredStatusNotifierItems", PropItems },
+};
+
+static Index methodindex = { methods, LENGTH(methods) };
+static Index signalindex = { signals, LENGTH(signals) };
+static Index propindex = { props, LENGTH(props) };
+
+static unsigned int
+hash(const char *member, size_t len)
+{
+	return (len * 7 + (unsigned char)member[0] * 3 +
+		(unsigned char)member[len - 1]) & (INDEX - 1);
+}
+
+static void
+build(Index *x)
+{
+	size_t i, len;
+	unsigned int h;
+
+	for (i = 0; i < x->n; i++) {
+		len = strlen(x->tab[i].member);
+		for (h = hash(x->tab[i].member, len); x->slot[h]; h = (h + 1) & (INDEX - 1))
+			;
+		x->slot[h] = i + 1;
+		x->len[h] = len;
+	}
+	x->built = 1;
+}
+
+/* A NULL iface matches the member on any interface. Entries sharing a
+ * member sit in the same probe run, so all of them are tried. */
+static int
+find(Index *x, const char *iface, const char *member)
+{
+	const Entry *e;
+	size_t len;
+	unsigned int h;
+
+	if (!member || !(len = strlen(member)))
+		return -1;
+	if (!x->built)
+		build(x);
+	for (h = hash(member, len); x->slot[h]; h = (h + 1) & (INDEX - 1)) {
+		e = &x->tab[x->slot[h] - 1];
+		if (x->len[h] == len && memcmp(e->member, member, len) == 0 &&
+		    (!iface || strcmp(e->iface, iface) == 0))
+			return e->id;
+	}
+	return -1;
+}
+
+int
+dispatch_method(const char *iface, const char *member)
+{
+	return find(&methodindex, iface, member);
+}
+
+int
+dispatch_signal(const char *iface, const char *member)
+{
+	/* Signals always carry an interface */
+	return iface ? find(&signalindex, iface, member) : -1;
+}
+
+int
+dispatch_prop(const char *name)
+{
+	return find(&propindex, NULL, name);
+}
+
+static const char *
+name(const Entry *tab, size_t n, int id)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (tab[i].id == id)
+			return tab[i].member;
+	return NULL;
+}
+
+const char *
+dispatch_methodname(int id)
+{
+	return name(methods, LENGTH(methods), id);
+}
+
+const char *
+dispatch_signalname(int id)
+{
+	return name(signals, LENGTH(signals), id);
+}
+
+const char *
+dispatch_propname(int id)
+{
+	return name(props, LENGTH(props), id);
+}
+
+/* Ids must index handler arrays, so each must appear exactly once, and
+ * an index needs a free slot to end a probe that misses */
+static int
+valid(const Entry *tab, size_t n, int last)
+{
+	size_t i, j;
+
+	if (n >= INDEX)
+		return 0;
+	for (i = 0; i < n; i++) {
+		if (tab[i].id < 0 || tab[i].id >= last)
+			return 0;
+		for (j = 0; j < i; j++)
+			if (tab[j].id == tab[i].id)
+				return 0;
+	}
+	return n == (size_t)last;
+}
+
+int
+dispatch_valid(void)
+{
+	return valid(methods, LENGTH(methods), MethodLast) &&
+		valid(signals, LENGTH(signals), SignalLast) &&
+		valid(props, LENGTH(props), PropLast);
+}
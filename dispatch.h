@@ -0,0 +1,40 @@
+/* See LICENSE file for copyright and license details. */
+
+#define WATCHER_IFACE "org.kde.StatusNotifierWatcher"
+#define ITEM_IFACE "org.kde.StatusNotifierItem"
+#define PROP_IFACE "org.freedesktop.DBus.Properties"
+#define INTROSPECT_IFACE "org.freedesktop.DBus.Introspectable"
+#define DBUSMENU_IFACE "com.canonical.dbusmenu"
+#define DBUS_IFACE "org.freedesktop.DBus"
+
+/* Interned ids for the messages dtray handles */
+enum {
+	MethodRegisterItem, MethodRegisterHost, MethodGet, MethodGetAll,
+	MethodIntrospect, MethodLast
+};
+enum {
+	SignalNameOwnerChanged, SignalNewIcon, SignalNewStatus, SignalNewTitle,
+	SignalLayoutUpdated, SignalItemsPropertiesUpdated, SignalLast
+};
+enum { PropHostRegistered, PropProtocolVersion, PropItems, PropLast };
+
+typedef struct {
+	const char *iface;
+	const char *member;
+	int id;
+} Entry;
+
+/* Map a method call on the watcher object to a Method id, or -1. A NULL
+ * iface matches the member on any of the object's interfaces. */
+int dispatch_method(const char *iface, const char *member);
+/* Map a signal to a Signal id, or -1 */
+int dispatch_signal(const char *iface, const char *member);
+/* Map a watcher property name to a Prop id, or -1 */
+int dispatch_prop(const char *name);
+/* Member names of ids, for reports */
+const char *dispatch_methodname(int id);
+const char *dispatch_signalname(int id);
+/* Name of a Prop id */
+const char *dispatch_propname(int id);
+/* Returns 1 if every table entry is consistent */
+int dispatch_valid(void);
@@ -0,0 +1,158 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * libdtray: the StatusNotifierWatcher core, independent of any display.
+ * A Backend shows the registered items; x11.c docks them as XEMBED
+ * icons, null.c only records what it was asked to do.
+ */
+
+#define MAX_ITEMS 64
+#define MENU_DEPTH 8  /* nesting limit for cached layouts and open popups */
+
+enum { BreakerClosed, BreakerOpen, BreakerHalfOpen };
+enum { ToggleNone, ToggleCheck, ToggleRadio };
+enum { TextStatus, TextTitle, TextLast }; /* item strings mirrored for shm */
+enum { OutRegistered, OutUnregistered, OutHostRegistered, OutMessage }; /* watcher signals */
+
+/* Per-item health of outgoing calls, used to size timeouts and to stop
+ * calling an app that keeps failing. */
+typedef struct {
+	int state;
+	int latency;   /* smoothed reply latency in ms, 0 if unknown */
+	int failures;  /* consecutive failures */
+	int backoff;   /* current open period in ms */
+	long long retry; /* when an open breaker admits a probe */
+	unsigned int nok, nfail;
+} Health;
+
+/* Cached com.canonical.dbusmenu layout node */
+typedef struct MenuNode MenuNode;
+struct MenuNode {
+	int id;
+	char *label;
+	int enabled;
+	int visible;
+	int separator;
+	int toggle;
+	int toggled;
+	int submenu;   /* children-display is "submenu" */
+	int nchildren;
+	MenuNode **children;
+};
+
+typedef struct {
+	char *service;
+	char *path;
+	char *id;       /* service and path, as announced to hosts */
+	Image src;      /* best source pixels, kept for local rescaling */
+	int scroll_dx; /* accumulated wheel steps not yet sent */
+	int scroll_dy;
+	Health health;
+	char *menu;           /* dbusmenu object path, NULL until known */
+	char *menu_owner;     /* unique name the menu signals come from */
+	MenuNode *layout;     /* cached menu tree */
+	DBusPendingCall *menu_call;
+	int menu_stale;       /* parent to refetch after menu_call, -1 if none */
+	char *text[TextLast]; /* Status and Title, NULL until known */
+	DBusPendingCall *text_call[TextLast];
+	int iconstale;  /* src is older than the app's icon */
+	void *priv;     /* backend state */
+} Item;
+
+typedef struct {
+	const char *name;
+	int (*init)(void);        /* returns 0 if the backend is unusable */
+	int (*fd)(void);          /* descriptor to wait on, -1 if none */
+	void (*process)(void);    /* handle pending display events */
+	void (*tick)(void);       /* after each wait, e.g. to follow the tray */
+	void (*add)(Item *item);  /* item registered */
+	void (*remove)(Item *item); /* item going away: release priv */
+	void (*icon)(Item *item); /* item->src changed */
+	int (*shown)(Item *item); /* item is on screen; NULL if always */
+	void (*menu)(Item *item); /* item->layout changed */
+	void (*reconfigure)(void); /* cfg was reloaded */
+	void (*cleanup)(void);
+} Backend;
+
+/* Runtime settings, filled from config.h by config_init() */
+typedef struct {
+	int iconsize;
+	int iconpadding;
+	int iconsrcmax;
+	const char *bgcolor;
+	int scrollinterval;
+	int timeoutmin;
+	int timeoutmax;
+	int timeoutfactor;
+	int breakerfailures;
+	int breakeropen;
+	int breakeropenmax;
+	const char *menufont;
+	const char *menufg;
+	const char *menubg;
+	const char *menuselfg;
+	const char *menuselbg;
+	const char *menudisfg;
+	const char *shmpath;
+	int shmicons;
+	int outqmax;
+	int destmax;
+	int destcalls;
+	int lagthreshold;
+	int lagheartbeat;
+} Config;
+
+extern Config cfg;
+extern Item items[MAX_ITEMS];
+extern int nitems;
+extern const Backend nullbackend, x11backend;
+extern int running; /* cleared to leave the main loop */
+
+/* config.c */
+void config_init(void);
+int config_load(const char *path);
+
+/* watcher.c; host is 0 to only act as a watcher for other hosts */
+int watcher_setup(const Backend *b, int host);
+int watcher_fd(void);
+int watcher_dispatch(void);
+int watcher_writing(void);
+void watcher_read(void);
+void watcher_dump(FILE *fp);
+void watcher_cleanup(void);
+void fetch_icon(Item *item);
+void activate_item(Item *item, int x, int y);
+void secondary_activate(Item *item, int x, int y);
+void context_menu(Item *item, int x, int y);
+void menu_notify(Item *item, int id, const char *event, unsigned long time);
+MenuNode *menu_find(MenuNode *n, int id);
+
+/* out.c */
+void out_setup(DBusConnection *c, const char *objpath);
+void out_signal(int sig, const char *arg);
+void out_broadcast(DBusMessage *msg);
+int out_send(DBusMessage *msg);
+void out_forget(const char *name);
+void out_flush(void);
+void out_dump(FILE *fp);
+void out_cleanup(void);
+
+/* shm.c */
+int shm_setup(const char *path, int iconmax);
+void shm_publish(void);
+void shm_cleanup(void);
+
+/* lag.c: the loop brackets each wakeup with lag_wake and lag_sleep,
+ * and work that may block with lag_enter and lag_leave */
+void lag_setup(void);
+void lag_reconfigure(void);
+void lag_wake(void);
+void lag_sleep(void);
+void lag_enter(const char *what, const Item *item);
+void lag_leave(void);
+void lag_dump(FILE *fp);
+
+/* null.c */
+enum { NullAdd, NullRemove, NullIcon, NullMenu, NullLast };
+extern unsigned long nullops[NullLast];
+extern FILE *nulllog; /* if set, each operation is logged there */
+void null_dump(FILE *fp);
@@ -0,0 +1,89 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * libFuzzer target for the IconPixmap decode path: make fuzz && ./fuzz
+ *
+ * Input: one byte of max size, one byte of scale size, then entries of
+ * int32 w, int32 h, uint32 len (little-endian) each followed by up to
+ * len bytes of pixel data. Lengths are taken as given, as a hostile app
+ * would send them, but never read past the input.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icon.h"
+
+static uint32_t
+get32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	IconEntry e[ICON_MAXENTRIES];
+	Image img, scaled;
+	size_t avail;
+	int n = 0, max, scale;
+
+	if (size < 2)
+		return 0;
+	max = data[0] + 1;
+	scale = data[1] + 1;
+	data += 2;
+	size -= 2;
+
+	while (size >= 12 && n < ICON_MAXENTRIES) {
+		e[n].w = (int32_t)get32(data);
+		e[n].h = (int32_t)get32(data + 4);
+		e[n].len = get32(data + 8);
+		data += 12;
+		size -= 12;
+		/* The D-Bus array length is always the real one */
+		avail = e[n].len < size ? e[n].len : size;
+		e[n].len = avail;
+		e[n].data = data;
+		data += avail;
+		size -= avail;
+		n++;
+	}
+
+	if (!icon_decode(&img, e, n, max))
+		return 0;
+	if (img.w < 1 || img.h < 1 || img.w > max || img.h > max)
+		abort();
+	if (icon_scale(&scaled, &img, scale)) {
+		if (scaled.w > scale || scaled.h > scale)
+			abort();
+		icon_free(&scaled);
+	}
+	icon_free(&img);
+	return 0;
+}
+
+#ifdef FUZZ_MAIN
+/* Replay inputs without libFuzzer, e.g. to reproduce a crash */
+int
+main(int argc, char *argv[])
+{
+	static uint8_t buf[1 << 22];
+	FILE *fp;
+	size_t n;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!(fp = fopen(argv[i], "rb"))) {
+			perror(argv[i]);
+			return 1;
+		}
+		n = fread(buf, 1, sizeof(buf), fp);
+		fclose(fp);
+		LLVMFuzzerTestOneInput(buf, n);
+	}
+	return 0;
+}
+#endif
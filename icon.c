@@ -0,0 +1,296 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Icon pixel handling that needs neither X nor D-Bus.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icon.h"
+
+/* Exact round(x / 255) for x <= 255 * 255, without a division */
+#define DIV255(x) (((x) + 128 + (((x) + 128) >> 8)) >> 8)
+/* Composite a premultiplied channel over background channel b */
+#define BLEND(c, b, ia) ((c) + DIV255((b) * (ia)))
+/* Rescale an 8-bit channel to bits, multiplying rather than dividing */
+#define CH(c, bits) (((c) * ((1u << (bits)) - 1) * 257 + 32768) >> 16)
+
+static uint32_t
+premultiply(const unsigned char *p)
+{
+	uint32_t a = p[0];
+
+	return a << 24 |
+		DIV255(p[1] * a) << 16 |
+		DIV255(p[2] * a) << 8 |
+		DIV255(p[3] * a);
+}
+
+static void
+fit(int w, int h, int size, int *dw, int *dh)
+{
+	if (w >= h) {
+		*dw = size;
+		*dh = (int)((long)h * size / w);
+	} else {
+		*dh = size;
+		*dw = (int)((long)w * size / h);
+	}
+	if (*dw < 1)
+		*dw = 1;
+	if (*dh < 1)
+		*dh = 1;
+}
+
+int
+icon_scale(Image *dst, const Image *src, int size)
+{
+	unsigned long long sum[4];
+	uint32_t p;
+	int dw, dh, x, y, sx, sy, x0, x1, y0, y1, n;
+
+	fit(src->w, src->h, size, &dw, &dh);
+	if (!(dst->px = malloc((size_t)dw * dh * sizeof(uint32_t))))
+		return 0;
+	dst->w = dw;
+	dst->h = dh;
+
+	for (y = 0; y < dh; y++) {
+		y0 = (int)((long)y * src->h / dh);
+		y1 = (int)((long)(y + 1) * src->h / dh);
+		if (y1 <= y0)
+			y1 = y0 + 1;
+		for (x = 0; x < dw; x++) {
+			x0 = (int)((long)x * src->w / dw);
+			x1 = (int)((long)(x + 1) * src->w / dw);
+			if (x1 <= x0)
+				x1 = x0 + 1;
+			/* Average the source block; premultiplied, so no fringes */
+			sum[0] = sum[1] = sum[2] = sum[3] = 0;
+			for (sy = y0; sy < y1; sy++) {
+				for (sx = x0; sx < x1; sx++) {
+					p = src->px[(size_t)sy * src->w + sx];
+					sum[0] += p >> 24;
+					sum[1] += p >> 16 & 0xff;
+					sum[2] += p >> 8 & 0xff;
+					sum[3] += p & 0xff;
+				}
+			}
+			n = (y1 - y0) * (x1 - x0);
+			dst->px[(size_t)y * dw + x] =
+				(uint32_t)((sum[0] + n / 2) / n) << 24 |
+				(uint32_t)((sum[1] + n / 2) / n) << 16 |
+				(uint32_t)((sum[2] + n / 2) / n) << 8 |
+				(uint32_t)((sum[3] + n / 2) / n);
+		}
+	}
+	return 1;
+}
+
+int
+icon_load(Image *img, const unsigned char *argb, int w, int h, int max)
+{
+	Image full;
+	size_t i, n = (size_t)w * h;
+
+	if (!(full.px = malloc(n * sizeof(uint32_t))))
+		return 0;
+	full.w = w;
+	full.h = h;
+	for (i = 0; i < n; i++)
+		full.px[i] = premultiply(argb + i * 4);
+
+	if (w <= max && h <= max) {
+		*img = full;
+		return 1;
+	}
+	i = icon_scale(img, &full, max);
+	free(full.px);
+	return i;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOSTMSB 1
+#else
+#define HOSTMSB 0
+#endif
+
+/* A 16-bit pixel goes out as one word in host order, swapped first if
+ * the image's order differs: the byte stores would not vectorize. A
+ * swapped 32-bit word does not vectorize either (SSE2 has no byte
+ * shuffle), so 32-bit pixels are stored bytewise, and byte-aligned msb
+ * layouts are instead given the byte-reversed lsb shifts below. */
+#define STORE16(d, v, msb) do { \
+	uint16_t w_ = (msb) != HOSTMSB ? ((v) >> 8 & 0xff) | ((v) & 0xff) << 8 : (v); \
+	memcpy((d), &w_, 2); \
+} while (0)
+#define STORE32(d, v, msb) do { \
+	(d)[0] = (msb) ? (v) >> 24 : (v); \
+	(d)[1] = (msb) ? (v) >> 16 : (v) >> 8; \
+	(d)[2] = (msb) ? (v) >> 8 : (v) >> 16; \
+	(d)[3] = (msb) ? (v) : (v) >> 24; \
+} while (0)
+
+/* A conversion kernel with its layout baked in at compile time: no
+ * branches in the loop, so the compiler can vectorize it when icon.c is
+ * built with KERNELFLAGS (see config.mk). */
+#define KERNEL(name, bpp, msb, rs, rb, gs, gb, bs, bb) \
+static void \
+name(const Format *f, unsigned char *restrict dst, const uint32_t *restrict src, \
+	size_t n, uint32_t bg) \
+{ \
+	uint32_t p, ia, v; \
+	size_t i; \
+\
+	for (i = 0; i < n; i++) { \
+		p = src[i]; \
+		ia = 255 - (p >> 24); \
+		v = CH(BLEND(p >> 16 & 0xff, bg >> 16 & 0xff, ia), rb) << (rs) | \
+			CH(BLEND(p >> 8 & 0xff, bg >> 8 & 0xff, ia), gb) << (gs) | \
+			CH(BLEND(p & 0xff, bg & 0xff, ia), bb) << (bs); \
+		STORE##bpp(dst + i * ((bpp) / 8), v, msb); \
+	} \
+}
+
+/* The 8888 msb kernels are lsb ones with each channel in the mirrored byte */
+KERNEL(xrgb8888_lsb, 32, 0, 16, 8, 8, 8, 0, 8)
+KERNEL(xrgb8888_msb, 32, 0, 8, 8, 16, 8, 24, 8)
+KERNEL(xbgr8888_lsb, 32, 0, 0, 8, 8, 8, 16, 8)
+KERNEL(xbgr8888_msb, 32, 0, 24, 8, 16, 8, 8, 8)
+KERNEL(xrgb2101010_lsb, 32, 0, 20, 10, 10, 10, 0, 10)
+KERNEL(xrgb2101010_msb, 32, 1, 20, 10, 10, 10, 0, 10)
+KERNEL(rgb565_lsb, 16, 0, 11, 5, 5, 6, 0, 5)
+KERNEL(rgb565_msb, 16, 1, 11, 5, 5, 6, 0, 5)
+
+/* Any other true colour layout, with shifts and widths from the masks */
+static void
+generic(const Format *f, unsigned char *dst, const uint32_t *src, size_t n, uint32_t bg)
+{
+	uint32_t p, ia, v;
+	size_t i;
+	int j, k, bytes = f->bpp / 8;
+
+	for (i = 0; i < n; i++) {
+		p = src[i];
+		ia = 255 - (p >> 24);
+		v = CH(BLEND(p >> 16 & 0xff, bg >> 16 & 0xff, ia), f->bits[0]) << f->shift[0] |
+			CH(BLEND(p >> 8 & 0xff, bg >> 8 & 0xff, ia), f->bits[1]) << f->shift[1] |
+			CH(BLEND(p & 0xff, bg & 0xff, ia), f->bits[2]) << f->shift[2];
+		for (j = 0; j < bytes; j++) {
+			k = f->msb ? bytes - 1 - j : j;
+			dst[i * bytes + j] = v >> (8 * k);
+		}
+	}
+}
+
+const Kernel icon_kernels[] = {
+	{ "xrgb8888 lsb", 0xff0000, 0x00ff00, 0x0000ff, 32, 0, xrgb8888_lsb },
+	{ "xrgb8888 msb", 0xff0000, 0x00ff00, 0x0000ff, 32, 1, xrgb8888_msb },
+	{ "xbgr8888 lsb", 0x0000ff, 0x00ff00, 0xff0000, 32, 0, xbgr8888_lsb },
+	{ "xbgr8888 msb", 0x0000ff, 0x00ff00, 0xff0000, 32, 1, xbgr8888_msb },
+	{ "xrgb2101010 lsb", 0x3ff00000, 0x000ffc00, 0x000003ff, 32, 0, xrgb2101010_lsb },
+	{ "xrgb2101010 msb", 0x3ff00000, 0x000ffc00, 0x000003ff, 32, 1, xrgb2101010_msb },
+	{ "rgb565 lsb", 0xf800, 0x07e0, 0x001f, 16, 0, rgb565_lsb },
+	{ "rgb565 msb", 0xf800, 0x07e0, 0x001f, 16, 1, rgb565_msb },
+	{ "generic", 0, 0, 0, 0, 0, generic },
+};
+const int icon_nkernels = sizeof(icon_kernels) / sizeof(icon_kernels[0]);
+
+static int
+mask_shift(uint32_t m)
+{
+	int s = 0;
+
+	while (m && !(m & 1)) {
+		m >>= 1;
+		s++;
+	}
+	return s;
+}
+
+static int
+mask_bits(uint32_t m)
+{
+	int b = 0;
+
+	for (m >>= mask_shift(m); m & 1; m >>= 1)
+		b++;
+	return b;
+}
+
+Convert
+icon_converter(Format *f)
+{
+	uint32_t masks[3];
+	int i;
+
+	masks[0] = f->rmask;
+	masks[1] = f->gmask;
+	masks[2] = f->bmask;
+	for (i = 0; i < 3; i++) {
+		if (!masks[i])
+			return NULL;
+		f->shift[i] = mask_shift(masks[i]);
+		f->bits[i] = mask_bits(masks[i]);
+		if (f->bits[i] > 16)
+			return NULL;
+	}
+	if (f->bpp != 16 && f->bpp != 24 && f->bpp != 32)
+		return NULL;
+
+	for (i = 0; i < icon_nkernels - 1; i++)
+		if (icon_kernels[i].rmask == f->rmask && icon_kernels[i].gmask == f->gmask &&
+		    icon_kernels[i].bmask == f->bmask && icon_kernels[i].bpp == f->bpp &&
+		    icon_kernels[i].msb == !!f->msb)
+			return icon_kernels[i].fn;
+	return generic;
+}
+
+static int
+valid(const IconEntry *e)
+{
+	/* Bounding w and h first keeps w * h * 4 from overflowing */
+	return e->data && e->w > 0 && e->h > 0 &&
+		e->w <= ICON_MAXDIM && e->h <= ICON_MAXDIM &&
+		e->len == (size_t)e->w * e->h * 4;
+}
+
+/* The longer side, which decides how far an entry is scaled */
+static int
+side(const IconEntry *e)
+{
+	return e->w > e->h ? e->w : e->h;
+}
+
+int
+icon_decode(Image *img, const IconEntry *e, int n, int max)
+{
+	const IconEntry *best = NULL;
+	int i, s;
+
+	if (max < 1)
+		return 0;
+	for (i = 0; i < n; i++) {
+		if (!valid(&e[i]))
+			continue;
+		/* Fitting entries beat oversized ones; among fitting ones
+		 * the largest wins, among oversized ones the smallest */
+		s = side(&e[i]);
+		if (!best || (s <= max ?
+		    (side(best) > max || s > side(best)) :
+		    (side(best) > max && s < side(best))))
+			best = &e[i];
+	}
+	return best && icon_load(img, best->data, best->w, best->h, max);
+}
+
+void
+icon_free(Image *img)
+{
+	free(img->px);
+	img->px = NULL;
+	img->w = 0;
+	img->h = 0;
+}
@@ -0,0 +1,55 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Premultiplied 0xAARRGGBB pixels in host byte order */
+typedef struct {
+	int w, h;
+	uint32_t *px;
+} Image;
+
+#define ICON_MAXDIM 1024    /* larger IconPixmap entries are rejected */
+#define ICON_MAXENTRIES 32  /* entries considered per IconPixmap */
+
+/* One IconPixmap entry as received; nothing about it is trusted */
+typedef struct {
+	int w, h;
+	const unsigned char *data; /* network-order ARGB */
+	size_t len;
+} IconEntry;
+
+/* Validate n entries, pick the largest fitting max x max (or the
+ * smallest larger one) and load it, shrunk to fit max x max. Returns 0
+ * if no entry is usable. */
+int icon_decode(Image *img, const IconEntry *e, int n, int max);
+/* Load SNI IconPixmap data (network-order ARGB, w * h * 4 bytes),
+ * shrinking it to fit max x max. Returns 0 on failure. */
+int icon_load(Image *img, const unsigned char *argb, int w, int h, int max);
+/* Resample src to fit size x size, keeping its aspect ratio: a box filter
+ * when shrinking, nearest neighbour when growing. Returns 0 on failure. */
+int icon_scale(Image *dst, const Image *src, int size);
+void icon_free(Image *img);
+
+/* Pixel layout of an X visual and image format */
+typedef struct {
+	uint32_t rmask, gmask, bmask;
+	int bpp;   /* bits per pixel: 16, 24 or 32 */
+	int msb;   /* image byte order is MSBFirst */
+	int shift[3], bits[3]; /* derived, for the generic kernel */
+} Format;
+
+/* Composite n premultiplied pixels over bg (0xRRGGBB) into dst */
+typedef void (*Convert)(const Format *f, unsigned char *dst,
+	const uint32_t *src, size_t n, uint32_t bg);
+
+typedef struct {
+	const char *name;
+	uint32_t rmask, gmask, bmask;
+	int bpp, msb;
+	Convert fn;
+} Kernel;
+
+extern const Kernel icon_kernels[];
+extern const int icon_nkernels;
+
+/* Pick the kernel for a layout, falling back to a generic one. Returns
+ * NULL if the layout is not a true colour one. */
+Convert icon_converter(Format *f);
@@ -0,0 +1,245 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Loop lag watchdog. Each wakeup of the main loop is timed, and so is
+ * each operation that may block inside it; operations nest, and each is
+ * charged only for the time not spent in the ones it called. A wakeup
+ * over cfg.lagthreshold is logged with the operation that took most of
+ * it and kept if it is among the worst. A loop that never gets back to
+ * lag_sleep is only seen by the optional heartbeat thread, which never
+ * reads cfg itself: lag_reconfigure hands it copies under the lock.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dbus/dbus.h>
+
+#include "icon.h"
+#include "dtray.h"
+#include "util.h"
+
+#define LAG_DEPTH 8
+#define LAG_WORST 16
+#define LAG_WINDOW (60 * 60 * 1000) /* older worst entries give way first */
+
+typedef struct {
+	const char *what;
+	const Item *item;
+	long long start, child;
+} Frame;
+
+typedef struct {
+	long long when;
+	int total, self;  /* ms for the wakeup, and in what */
+	const char *what;
+	char item[128];
+} Stall;
+
+static Frame stack[LAG_DEPTH];
+static int depth;
+static Stall cur, worst[LAG_WORST];
+static unsigned long nwake, nslow;
+static long long busy, maxwake;
+static long long outside; /* ms this wakeup spent in operations */
+
+/* Shared with the heartbeat; doing is only ever a string constant */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static long long woke;  /* 0 while the loop waits */
+static int hbinterval, hbthreshold; /* cfg.lagheartbeat, cfg.lagthreshold */
+static const char *doing = "loop"; /* only through __atomic builtins */
+
+static void *
+heartbeat(void *arg)
+{
+	struct timespec ts;
+	long long w, reported = 0, now;
+	int ms, threshold;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		ms = hbinterval > 0 ? hbinterval : 1000;
+		pthread_mutex_unlock(&lock);
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = ms % 1000 * 1000000L;
+		nanosleep(&ts, NULL);
+
+		pthread_mutex_lock(&lock);
+		w = woke;
+		threshold = hbinterval > 0 ? hbthreshold : 0;
+		pthread_mutex_unlock(&lock);
+		if (!w || w == reported || threshold <= 0)
+			continue;
+		/* Once per stall; lag_sleep logs the full story if it ends */
+		if ((now = now_ms()) - w >= threshold) {
+			reported = w;
+			fprintf(stderr, "dtray: loop stalled for %lldms in %s\n", now - w,
+				__atomic_load_n(&doing, __ATOMIC_RELAXED));
+		}
+	}
+	return NULL;
+}
+
+void
+lag_setup(void)
+{
+	pthread_attr_t attr;
+	pthread_t t;
+	sigset_t all, old;
+
+	lag_reconfigure();
+	if (cfg.lagheartbeat <= 0)
+		return;
+	/* Signals are for the loop's select, not for the heartbeat */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&t, &attr, heartbeat, NULL) != 0)
+		fprintf(stderr, "dtray: cannot start the lag heartbeat\n");
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* After cfg changes; a heartbeat not started at setup stays off */
+void
+lag_reconfigure(void)
+{
+	pthread_mutex_lock(&lock);
+	hbinterval = cfg.lagheartbeat;
+	hbthreshold = cfg.lagthreshold;
+	pthread_mutex_unlock(&lock);
+}
+
+void
+lag_wake(void)
+{
+	long long now = now_ms();
+
+	pthread_mutex_lock(&lock);
+	woke = now;
+	pthread_mutex_unlock(&lock);
+	memset(&cur, 0, sizeof(cur));
+	cur.when = now;
+	outside = 0;
+	__atomic_store_n(&doing, "loop", __ATOMIC_RELAXED);
+}
+
+/* Replace an expired entry, else the mildest if cur is worse */
+static void
+keep(void)
+{
+	Stall *s = NULL;
+	int i;
+
+	for (i = 0; i < LAG_WORST; i++) {
+		if (!worst[i].when || cur.when - worst[i].when > LAG_WINDOW) {
+			s = &worst[i];
+			break;
+		}
+		if (!s || worst[i].total < s->total)
+			s = &worst[i];
+	}
+	if (s->when && cur.when - s->when <= LAG_WINDOW && s->total >= cur.total)
+		return;
+	*s = cur;
+}
+
+void
+lag_sleep(void)
+{
+	long long now = now_ms();
+	int t;
+
+	pthread_mutex_lock(&lock);
+	t = now - woke;
+	woke = 0;
+	pthread_mutex_unlock(&lock);
+
+	nwake++;
+	busy += t;
+	if (t > maxwake)
+		maxwake = t;
+	if (cfg.lagthreshold <= 0 || t < cfg.lagthreshold)
+		return;
+	nslow++;
+	cur.total = t;
+	/* Time in no operation at all is the loop's own */
+	if (!cur.what || t - outside > cur.self) {
+		cur.self = t - outside;
+		cur.what = "loop";
+		cur.item[0] = '\0';
+	}
+	fprintf(stderr, "dtray: loop took %dms, %dms of it in %s%s%s\n", t,
+		cur.self, cur.what, cur.item[0] ? " for " : "", cur.item);
+	keep();
+}
+
+void
+lag_enter(const char *what, const Item *item)
+{
+	Frame *f;
+
+	if (depth++ >= LAG_DEPTH)
+		return;
+	f = &stack[depth - 1];
+	f->what = what;
+	f->item = item;
+	f->start = now_ms();
+	f->child = 0;
+	__atomic_store_n(&doing, what, __ATOMIC_RELAXED);
+}
+
+void
+lag_leave(void)
+{
+	Frame *f;
+	long long t;
+	int self;
+
+	if (!depth || --depth >= LAG_DEPTH)
+		return;
+	f = &stack[depth];
+	t = now_ms() - f->start;
+	self = t - f->child;
+	if (depth)
+		stack[depth - 1].child += t;
+	else
+		outside += t;
+	__atomic_store_n(&doing, depth ? stack[depth - 1].what : "loop",
+		__ATOMIC_RELAXED);
+	if (self <= cur.self)
+		return;
+	cur.self = self;
+	cur.what = f->what;
+	cur.item[0] = '\0';
+	/* The item may have gone away meanwhile; its slot stays */
+	if (f->item && f->item->id)
+		snprintf(cur.item, sizeof(cur.item), "%s", f->item->id);
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	return ((const Stall *)b)->total - ((const Stall *)a)->total;
+}
+
+void
+lag_dump(FILE *fp)
+{
+	Stall s[LAG_WORST];
+	long long now = now_ms();
+	int i;
+
+	fprintf(fp, "dtray: lag: wakeups=%lu slow=%lu mean=%.2fms max=%lldms\n",
+		nwake, nslow, nwake ? (double)busy / nwake : 0, maxwake);
+	memcpy(s, worst, sizeof(s));
+	qsort(s, LAG_WORST, sizeof(*s), cmp);
+	for (i = 0; i < LAG_WORST && s[i].when; i++)
+		fprintf(fp, "dtray:   %dms %llds ago: %dms in %s%s%s\n", s[i].total,
+			(now - s[i].when) / 1000, s[i].self, s[i].what,
+			s[i].item[0] ? " for " : "", s[i].item);
+}
@@ -0,0 +1,66 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Null backend: shows nothing, only counts and optionally logs what the
+ * watcher asked of it. Used for --watcher-only and to drive the core
+ * without a display.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <dbus/dbus.h>
+
+#include "icon.h"
+#include "dtray.h"
+
+unsigned long nullops[NullLast];
+FILE *nulllog;
+
+static void
+record(int op, const char *what, Item *item)
+{
+	nullops[op]++;
+	if (nulllog)
+		fprintf(nulllog, "%s %s%s\n", what, item->service, item->path);
+}
+
+static void
+null_add(Item *item)
+{
+	record(NullAdd, "add", item);
+}
+
+static void
+null_remove(Item *item)
+{
+	record(NullRemove, "remove", item);
+}
+
+static void
+null_icon(Item *item)
+{
+	nullops[NullIcon]++;
+	if (nulllog)
+		fprintf(nulllog, "icon %s%s %dx%d\n", item->service, item->path,
+			item->src.w, item->src.h);
+}
+
+static void
+null_menu(Item *item)
+{
+	record(NullMenu, "menu", item);
+}
+
+void
+null_dump(FILE *fp)
+{
+	fprintf(fp, "dtray: null: add=%lu remove=%lu icon=%lu menu=%lu\n",
+		nullops[NullAdd], nullops[NullRemove], nullops[NullIcon], nullops[NullMenu]);
+}
+
+const Backend nullbackend = {
+	.name = "null",
+	.add = null_add,
+	.remove = null_remove,
+	.icon = null_icon,
+	.menu = null_menu,
+};
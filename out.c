@@ -0,0 +1,405 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Outbound messages. Watcher signals are held until the end of the loop
+ * iteration, where an item registered and unregistered in between (or
+ * the reverse) cancels out and duplicates collapse; other broadcasts
+ * queue behind them, so listeners see a change after its signal.
+ *
+ * A slow peer is one that does not answer: calls to it are sent with a
+ * reply, and once destcalls of them are unanswered its further calls
+ * are deferred, up to destmax bytes, and dropped past that. Everything
+ * is also deferred while libdbus holds more than outqmax unsent bytes,
+ * i.e. while the bus connection itself is slow; broadcasts then wait in
+ * the batch, which is bounded.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#include "dispatch.h"
+#include "icon.h"
+#include "dtray.h"
+#include "trace.h"
+
+#define MAX_DESTS 32
+#define MAX_SIGNALS 256
+
+typedef struct Deferred Deferred;
+struct Deferred {
+	DBusMessage *msg;
+	size_t len;
+	Deferred *next;
+};
+
+typedef struct Dest Dest;
+typedef struct Call Call;
+struct Call {
+	DBusPendingCall *pending;
+	Dest *dest;
+	Call *next;
+};
+
+struct Dest {
+	char *name;       /* NULL if the slot is free */
+	Deferred *head, *tail;
+	size_t bytes;     /* deferred */
+	Call *calls;      /* sent and not answered yet */
+	int ncalls;
+};
+
+typedef struct {
+	int sig;
+	char *arg;
+	DBusMessage *msg; /* for OutMessage */
+} Signal;
+
+static const char *signames[] = {
+	[OutRegistered] = "StatusNotifierItemRegistered",
+	[OutUnregistered] = "StatusNotifierItemUnregistered",
+	[OutHostRegistered] = "StatusNotifierHostRegistered",
+};
+
+static DBusConnection *conn;
+static const char *path;
+static Dest dests[MAX_DESTS];
+static Signal signals[MAX_SIGNALS];
+static int nsignals;
+static unsigned long nsent, ndeferred, ndropped, ncancelled, nfailed;
+
+static void flush_signals(int force);
+
+void
+out_setup(DBusConnection *c, const char *objpath)
+{
+	conn = c;
+	path = objpath;
+}
+
+static int
+sameargs(const Signal *s, const char *arg)
+{
+	return (!s->arg && !arg) || (s->arg && arg && strcmp(s->arg, arg) == 0);
+}
+
+/* Queue a watcher signal for the end of the iteration */
+void
+out_signal(int sig, const char *arg)
+{
+	int i, other = sig == OutRegistered ? OutUnregistered :
+		sig == OutUnregistered ? OutRegistered : -1;
+
+	for (i = nsignals - 1; i >= 0; i--) {
+		/* Listeners may have acted on what went out in between */
+		if (signals[i].sig == OutMessage)
+			break;
+		if (!sameargs(&signals[i], arg))
+			continue;
+		if (signals[i].sig == sig)
+			return;
+		if (signals[i].sig == other) {
+			/* Listeners would end up where they are now */
+			free(signals[i].arg);
+			memmove(&signals[i], &signals[i + 1], (--nsignals - i) * sizeof(Signal));
+			ncancelled += 2;
+			return;
+		}
+	}
+	if (nsignals == MAX_SIGNALS)
+		flush_signals(1);
+	signals[nsignals].sig = sig;
+	signals[nsignals].arg = arg ? strdup(arg) : NULL;
+	signals[nsignals].msg = NULL;
+	nsignals++;
+}
+
+/* Queue a broadcast behind the batched signals. Takes no reference
+ * from the caller. */
+void
+out_broadcast(DBusMessage *msg)
+{
+	if (nsignals == MAX_SIGNALS)
+		flush_signals(1);
+	signals[nsignals].sig = OutMessage;
+	signals[nsignals].arg = NULL;
+	signals[nsignals].msg = dbus_message_ref(msg);
+	nsignals++;
+}
+
+static void
+emit(Signal *s)
+{
+	DBusMessage *msg;
+
+	if (s->sig == OutMessage)
+		msg = s->msg;
+	else
+		msg = dbus_message_new_signal(path, WATCHER_IFACE, signames[s->sig]);
+	if (msg) {
+		if (s->arg)
+			dbus_message_append_args(msg, DBUS_TYPE_STRING, &s->arg, DBUS_TYPE_INVALID);
+		dbus_connection_send(conn, msg, NULL);
+		dbus_message_unref(msg);
+	}
+	free(s->arg);
+}
+
+static Dest *
+dest_get(const char *name, int create)
+{
+	Dest *slot = NULL;
+	int i;
+
+	for (i = 0; i < MAX_DESTS; i++) {
+		if (!dests[i].name) {
+			if (!slot)
+				slot = &dests[i];
+		} else if (strcmp(dests[i].name, name) == 0) {
+			return &dests[i];
+		}
+	}
+	if (!create || !slot || !(slot->name = strdup(name)))
+		return NULL;
+	return slot;
+}
+
+/* Free the slot once nothing is deferred or awaited */
+static void
+dest_release(Dest *dest)
+{
+	if (dest->head || dest->calls)
+		return;
+	free(dest->name);
+	memset(dest, 0, sizeof(*dest));
+}
+
+static size_t
+msglen(DBusMessage *msg)
+{
+	char *buf;
+	int len;
+
+	if (!dbus_message_marshal(msg, &buf, &len))
+		return 0;
+	free(buf);
+	return len;
+}
+
+static int
+congested(void)
+{
+	return dbus_connection_get_outgoing_size(conn) >= cfg.outqmax;
+}
+
+static int
+iscall(DBusMessage *msg)
+{
+	return dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+		!dbus_message_get_no_reply(msg);
+}
+
+/* Returns 1 if msg may not go to dest yet */
+static int
+blocked(Dest *dest, DBusMessage *msg)
+{
+	return congested() || (dest && iscall(msg) && dest->ncalls >= cfg.destcalls);
+}
+
+static void
+answered(DBusPendingCall *pending, void *data)
+{
+	Call *c = data, **p;
+	Dest *dest = c->dest;
+	DBusMessage *reply;
+
+	if ((reply = dbus_pending_call_steal_reply(pending))) {
+		trace_pending_reply(pending, reply);
+		if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR)
+			nfailed++;
+		dbus_message_unref(reply);
+	}
+	for (p = &dest->calls; *p; p = &(*p)->next) {
+		if (*p == c) {
+			*p = c->next;
+			break;
+		}
+	}
+	dest->ncalls--;
+	dbus_pending_call_unref(pending);
+	free(c);
+	dest_release(dest);
+}
+
+/* Hand msg to libdbus; a call is counted against dest until answered */
+static int
+transmit(Dest *dest, DBusMessage *msg)
+{
+	Call *c;
+
+	nsent++;
+	if (!dest || !iscall(msg))
+		return dbus_connection_send(conn, msg, NULL);
+	if (!(c = calloc(1, sizeof(*c))))
+		return 0;
+	if (!dbus_connection_send_with_reply(conn, msg, &c->pending, cfg.timeoutmax) ||
+	    !c->pending) {
+		free(c);
+		return 0;
+	}
+	dbus_pending_call_set_notify(c->pending, answered, c, NULL);
+	trace_pending(c->pending, msg);
+	c->dest = dest;
+	c->next = dest->calls;
+	dest->calls = c;
+	dest->ncalls++;
+	return 1;
+}
+
+/* Send a message to one peer, subject to backpressure. Takes no
+ * reference from the caller. Returns 0 if it was dropped. */
+int
+out_send(DBusMessage *msg)
+{
+	const char *name = dbus_message_get_destination(msg);
+	Deferred *d;
+	Dest *dest;
+	size_t len;
+	int ret;
+
+	if (!name) {
+		nsent++;
+		return dbus_connection_send(conn, msg, NULL);
+	}
+	/* Keep order: once deferred, later sends queue behind */
+	dest = dest_get(name, iscall(msg));
+	if (!(dest && dest->head) && !blocked(dest, msg)) {
+		ret = transmit(dest, msg);
+		if (dest)
+			dest_release(dest);
+		return ret;
+	}
+
+	len = msglen(msg);
+	if (!(dest = dest_get(name, 1)) || dest->bytes + len > (size_t)cfg.destmax ||
+	    !(d = malloc(sizeof(*d)))) {
+		if (dest)
+			dest_release(dest);
+		ndropped++;
+		return 0;
+	}
+	d->msg = dbus_message_ref(msg);
+	d->len = len;
+	d->next = NULL;
+	if (dest->tail)
+		dest->tail->next = d;
+	else
+		dest->head = d;
+	dest->tail = d;
+	dest->bytes += len;
+	ndeferred++;
+	return 1;
+}
+
+/* Drop what is deferred for or awaited from a peer that left the bus */
+void
+out_forget(const char *name)
+{
+	Dest *dest = dest_get(name, 0);
+	Deferred *d;
+	Call *c;
+
+	if (!dest)
+		return;
+	while ((d = dest->head)) {
+		dest->head = d->next;
+		dbus_message_unref(d->msg);
+		free(d);
+		ndropped++;
+	}
+	while ((c = dest->calls)) {
+		dest->calls = c->next;
+		dbus_pending_call_cancel(c->pending);
+		dbus_pending_call_unref(c->pending);
+		free(c);
+	}
+	free(dest->name);
+	memset(dest, 0, sizeof(*dest));
+}
+
+/* Emit the batched signals while the connection has room, or all of
+ * them if force is set */
+static void
+flush_signals(int force)
+{
+	int i;
+
+	for (i = 0; i < nsignals && (force || !congested()); i++)
+		emit(&signals[i]);
+	memmove(signals, &signals[i], (nsignals - i) * sizeof(Signal));
+	nsignals -= i;
+}
+
+/* Emit the batched signals and hand deferred messages to libdbus, one
+ * per destination in turn while it has room */
+void
+out_flush(void)
+{
+	Deferred *d;
+	Dest *dest;
+	int i, moved;
+
+	flush_signals(0);
+
+	do {
+		moved = 0;
+		for (i = 0; i < MAX_DESTS && !congested(); i++) {
+			dest = &dests[i];
+			if (!(d = dest->head) || blocked(dest, d->msg))
+				continue;
+			dest->head = d->next;
+			dest->bytes -= d->len;
+			if (!transmit(dest, d->msg))
+				ndropped++;
+			dbus_message_unref(d->msg);
+			free(d);
+			moved = 1;
+			if (!dest->head)
+				dest->tail = NULL;
+			dest_release(dest);
+		}
+	} while (moved && !congested());
+}
+
+void
+out_dump(FILE *fp)
+{
+	int i, n = 0, calls = 0;
+
+	for (i = 0; i < MAX_DESTS; i++) {
+		n += dests[i].head != NULL;
+		calls += dests[i].ncalls;
+	}
+	fprintf(fp, "dtray: out: sent=%lu deferred=%lu dropped=%lu cancelled=%lu"
+		" queued=%ldB backlogged=%d awaiting=%d failed=%lu\n", nsent, ndeferred,
+		ndropped, ncancelled, conn ? dbus_connection_get_outgoing_size(conn) : 0,
+		n, calls, nfailed);
+}
+
+void
+out_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < nsignals; i++) {
+		free(signals[i].arg);
+		if (signals[i].msg)
+			dbus_message_unref(signals[i].msg);
+	}
+	nsignals = 0;
+	for (i = 0; i < MAX_DESTS; i++)
+		if (dests[i].name)
+			out_forget(dests[i].name);
+	conn = NULL;
+}
@@ -0,0 +1,588 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Replays a trace recorded with dtray -r through the watcher core as
+ * fast as it will go. Run with: make replay && ./replay trace
+ *
+ * There is no bus: this file defines the libdbus connection and pending
+ * call functions the core uses, so the core links against these stubs
+ * instead. Calls it makes are answered with the replies recorded for the
+ * same call, in order. X input goes to a stub backend that does the
+ * rescaling the X backend would.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dbus/dbus.h>
+
+#include "icon.h"
+#include "dtray.h"
+#include "trace.h"
+#include "util.h"
+
+#define MAX_FILTERS 4
+#define EPOCH (24 * 60 * 60 * 1000LL) /* trace time 0; the core reads 0 as never */
+
+enum { LatCall, LatSignal, LatX, LatLast };
+
+typedef struct Reply Reply;
+struct Reply {
+	char *key;
+	DBusMessage *msg;
+	Reply *next;
+};
+
+typedef struct Pending Pending;
+struct Pending {
+	DBusPendingCallNotifyFunction fn;
+	void *data;
+	DBusFreeFunction freedata;
+	DBusMessage *reply;
+	int refs, cancelled;
+	Pending *next;
+};
+
+typedef struct {
+	int size;
+	Image scaled;
+} Stub;
+
+int running = 1;
+
+static char busobj; /* stands in for the connection */
+static DBusHandleMessageFunction filters[MAX_FILTERS];
+static int nfilters;
+static DBusObjectPathVTable objvtable;
+static char *objpath;
+static Reply *replies, **lastreply = &replies;
+static DBusMessage *incoming;
+static Pending *done, **lastdone = &done;
+static unsigned long nsent, ncalls, nmissed;
+static dbus_uint32_t lastserial;
+
+static Format format = {
+	.rmask = 0xff0000, .gmask = 0xff00, .bmask = 0xff, .bpp = 32
+};
+static Convert convert;
+static int iconsize;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The recorded reply to an equivalent call, taken in trace order */
+static DBusMessage *
+reply_take(DBusMessage *call)
+{
+	char key[TRACE_KEY];
+	Reply **r, *f;
+	DBusMessage *msg;
+
+	ncalls++;
+	trace_key(call, key, sizeof(key));
+	for (r = &replies; *r; r = &(*r)->next) {
+		if (strcmp((*r)->key, key) != 0)
+			continue;
+		f = *r;
+		if (!(*r = f->next))
+			lastreply = r;
+		msg = f->msg;
+		free(f->key);
+		free(f);
+		return msg;
+	}
+	nmissed++;
+	return NULL;
+}
+
+static void
+pending_done(Pending *p)
+{
+	p->next = NULL;
+	*lastdone = p;
+	lastdone = &p->next;
+}
+
+/* Stub bus: connection */
+
+DBusConnection *
+dbus_bus_get(DBusBusType type, DBusError *error)
+{
+	return (DBusConnection *)&busobj;
+}
+
+int
+dbus_bus_request_name(DBusConnection *c, const char *name, unsigned int flags,
+	DBusError *error)
+{
+	return DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER;
+}
+
+void
+dbus_bus_add_match(DBusConnection *c, const char *rule, DBusError *error)
+{
+}
+
+dbus_bool_t
+dbus_connection_register_object_path(DBusConnection *c, const char *path,
+	const DBusObjectPathVTable *vtable, void *data)
+{
+	objvtable = *vtable;
+	objpath = strdup(path);
+	return objpath != NULL;
+}
+
+dbus_bool_t
+dbus_connection_add_filter(DBusConnection *c, DBusHandleMessageFunction fn,
+	void *data, DBusFreeFunction freedata)
+{
+	if (nfilters == MAX_FILTERS)
+		return FALSE;
+	filters[nfilters++] = fn;
+	return TRUE;
+}
+
+dbus_bool_t
+dbus_connection_get_unix_fd(DBusConnection *c, int *fd)
+{
+	return FALSE;
+}
+
+dbus_bool_t
+dbus_connection_read_write(DBusConnection *c, int timeout)
+{
+	return TRUE;
+}
+
+long
+dbus_connection_get_outgoing_size(DBusConnection *c)
+{
+	return 0;
+}
+
+dbus_bool_t
+dbus_connection_has_messages_to_send(DBusConnection *c)
+{
+	return FALSE;
+}
+
+DBusDispatchStatus
+dbus_connection_get_dispatch_status(DBusConnection *c)
+{
+	return done || incoming ? DBUS_DISPATCH_DATA_REMAINS : DBUS_DISPATCH_COMPLETE;
+}
+
+/* Completed calls first, then the message being replayed, which goes
+ * through the filters and then the object path, as libdbus does */
+DBusDispatchStatus
+dbus_connection_dispatch(DBusConnection *c)
+{
+	DBusMessage *msg;
+	Pending *p;
+	const char *path;
+	int i;
+
+	if ((p = done)) {
+		if (!(done = p->next))
+			lastdone = &done;
+		if (!p->cancelled && p->fn)
+			p->fn((DBusPendingCall *)p, p->data);
+		dbus_pending_call_unref((DBusPendingCall *)p);
+	} else if ((msg = incoming)) {
+		incoming = NULL;
+		for (i = 0; i < nfilters; i++)
+			if (filters[i](c, msg, NULL) == DBUS_HANDLER_RESULT_HANDLED)
+				break;
+		path = dbus_message_get_path(msg);
+		if (i == nfilters && objpath && path && strcmp(path, objpath) == 0 &&
+		    dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+			objvtable.message_function(c, msg, NULL);
+		dbus_message_unref(msg);
+	}
+	return dbus_connection_get_dispatch_status(c);
+}
+
+dbus_bool_t
+dbus_connection_send(DBusConnection *c, DBusMessage *msg, dbus_uint32_t *serial)
+{
+	nsent++;
+	return TRUE;
+}
+
+dbus_bool_t
+dbus_connection_send_with_reply(DBusConnection *c, DBusMessage *msg,
+	DBusPendingCall **pending, int timeout)
+{
+	Pending *p;
+
+	if (!(p = calloc(1, sizeof(*p))))
+		return FALSE;
+	nsent++;
+	/* Errors made up below need a serial to answer */
+	dbus_message_set_serial(msg, ++lastserial);
+	if (!(p->reply = reply_take(msg)))
+		p->reply = dbus_message_new_error(msg, DBUS_ERROR_NO_REPLY, "not in trace");
+	p->refs = 2; /* the caller's and the queue's */
+	pending_done(p);
+	*pending = (DBusPendingCall *)p;
+	return TRUE;
+}
+
+DBusMessage *
+dbus_connection_send_with_reply_and_block(DBusConnection *c, DBusMessage *msg,
+	int timeout, DBusError *error)
+{
+	DBusMessage *reply;
+
+	nsent++;
+	if (!(reply = reply_take(msg))) {
+		dbus_set_error(error, DBUS_ERROR_NO_REPLY, "not in trace");
+		return NULL;
+	}
+	if (dbus_set_error_from_message(error, reply)) {
+		dbus_message_unref(reply);
+		return NULL;
+	}
+	return reply;
+}
+
+void
+dbus_connection_unref(DBusConnection *c)
+{
+}
+
+/* Stub bus: pending calls */
+
+dbus_bool_t
+dbus_pending_call_set_notify(DBusPendingCall *pending,
+	DBusPendingCallNotifyFunction fn, void *data, DBusFreeFunction freedata)
+{
+	Pending *p = (Pending *)pending;
+
+	p->fn = fn;
+	p->data = data;
+	p->freedata = freedata;
+	return TRUE;
+}
+
+DBusMessage *
+dbus_pending_call_steal_reply(DBusPendingCall *pending)
+{
+	Pending *p = (Pending *)pending;
+	DBusMessage *reply = p->reply;
+
+	p->reply = NULL;
+	return reply;
+}
+
+void
+dbus_pending_call_cancel(DBusPendingCall *pending)
+{
+	((Pending *)pending)->cancelled = 1;
+}
+
+void
+dbus_pending_call_unref(DBusPendingCall *pending)
+{
+	Pending *p = (Pending *)pending;
+
+	if (--p->refs > 0)
+		return;
+	if (p->reply)
+		dbus_message_unref(p->reply);
+	if (p->freedata)
+		p->freedata(p->data);
+	free(p);
+}
+
+/* Stub X backend: keeps a scaled, converted copy like a dock would */
+
+static void
+stub_render(Item *item)
+{
+	Stub *s = item->priv;
+	unsigned char *buf;
+
+	icon_free(&s->scaled);
+	if (!item->src.px || !icon_scale(&s->scaled, &item->src, s->size))
+		return;
+	if ((buf = malloc((size_t)s->scaled.w * s->scaled.h * 4))) {
+		convert(&format, buf, s->scaled.px, (size_t)s->scaled.w * s->scaled.h, 0);
+		free(buf);
+	}
+}
+
+static void
+stub_add(Item *item)
+{
+	Stub *s;
+
+	if ((s = calloc(1, sizeof(*s))))
+		s->size = iconsize;
+	item->priv = s;
+}
+
+static void
+stub_remove(Item *item)
+{
+	Stub *s = item->priv;
+
+	if (s)
+		icon_free(&s->scaled);
+	free(s);
+	item->priv = NULL;
+}
+
+static void
+stub_icon(Item *item)
+{
+	if (item->priv)
+		stub_render(item);
+}
+
+static const Backend stubbackend = {
+	.name = "replay",
+	.add = stub_add,
+	.remove = stub_remove,
+	.icon = stub_icon,
+};
+
+static Item *
+find_item(const char *id)
+{
+	int i;
+
+	for (i = 0; i < nitems; i++)
+		if (items[i].id && strcmp(items[i].id, id) == 0)
+			return &items[i];
+	return NULL;
+}
+
+/* What the X backend does with the same input */
+static void
+replay_x(const TraceXEvent *e, const char *id)
+{
+	Item *item;
+	Stub *s;
+
+	if (!(item = find_item(id)))
+		return;
+	switch (e->what) {
+	case XPress:
+		switch (e->button) {
+		case 1: activate_item(item, e->a, e->b); break;
+		case 2: secondary_activate(item, e->a, e->b); break;
+		case 3:
+			if (item->layout) {
+				menu_notify(item, item->layout->id, NULL, 0);
+				menu_notify(item, item->layout->id, "opened", 0);
+			} else
+				context_menu(item, e->a, e->b);
+			break;
+		case 4: item->scroll_dy++; break;
+		case 5: item->scroll_dy--; break;
+		case 6: item->scroll_dx--; break;
+		case 7: item->scroll_dx++; break;
+		}
+		break;
+	case XResize:
+		if ((s = item->priv) && (s->size = e->a < e->b ? e->a : e->b) > 0)
+			stub_render(item);
+		break;
+	case XMenuClick:
+		menu_notify(item, e->a, "clicked", 0);
+		break;
+	}
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(const char *name, double *lat, size_t n)
+{
+	if (!n)
+		return;
+	qsort(lat, n, sizeof(*lat), cmp);
+	printf("%-8s %8zu events  p50 %8.2fus  p99 %8.2fus  max %8.2fus\n", name, n,
+		lat[n / 2] * 1e6, lat[n * 99 / 100] * 1e6, lat[n - 1] * 1e6);
+}
+
+static unsigned char *
+slurp(const char *path, size_t *len)
+{
+	FILE *fp;
+	unsigned char *buf = NULL, *p;
+	size_t cap = 0, n;
+
+	if (!(fp = fopen(path, "rb")))
+		return NULL;
+	*len = 0;
+	do {
+		if (*len == cap) {
+			cap = cap ? cap * 2 : 1 << 16;
+			if (!(p = realloc(buf, cap))) {
+				free(buf);
+				fclose(fp);
+				return NULL;
+			}
+			buf = p;
+		}
+		n = fread(buf + *len, 1, cap - *len, fp);
+		*len += n;
+	} while (n);
+	fclose(fp);
+	return buf;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *names[LatLast] = { "calls", "signals", "x" };
+	const TraceHeader *h;
+	TraceRecord r;
+	DBusMessage *msg;
+	DBusError err;
+	Reply *rep;
+	unsigned char *buf;
+	size_t len, off, keylen, n[LatLast] = { 0 }, total;
+	double *lat[LatLast], start, t, elapsed;
+	unsigned long long recorded = 0;
+	const char *path;
+	char shmpath[] = "/tmp/dtray-replay.XXXXXX";
+	int fd, i, k;
+
+	/* -l logs what a --watcher-only trace asks of the null backend */
+	if (argc == 3 && strcmp(argv[1], "-l") == 0)
+		nulllog = stderr;
+	else if (argc != 2) {
+		fprintf(stderr, "usage: replay [-l] trace\n");
+		return 1;
+	}
+	path = argv[argc - 1];
+	if (!(buf = slurp(path, &len)) || len < sizeof(*h)) {
+		fprintf(stderr, "replay: cannot read %s\n", path);
+		return 1;
+	}
+	h = (const TraceHeader *)buf;
+	if (h->magic != TRACE_MAGIC || h->version != TRACE_VERSION) {
+		fprintf(stderr, "replay: %s is not a dtray trace\n", path);
+		return 1;
+	}
+
+	/* Replies are looked up by call; everything else is replayed */
+	dbus_error_init(&err);
+	for (off = sizeof(*h), total = 0; off + sizeof(r) <= len; off += r.len) {
+		memcpy(&r, buf + off, sizeof(r));
+		off += sizeof(r);
+		if (r.len > len - off)
+			break;
+		if (r.kind != TraceReply) {
+			total++;
+			continue;
+		}
+		keylen = strnlen((char *)buf + off, r.len);
+		if (keylen == r.len || !(rep = calloc(1, sizeof(*rep))))
+			continue;
+		rep->msg = dbus_message_demarshal((char *)buf + off + keylen + 1,
+			r.len - keylen - 1, &err);
+		if (!rep->msg || !(rep->key = strdup((char *)buf + off))) {
+			dbus_error_free(&err);
+			if (rep->msg)
+				dbus_message_unref(rep->msg);
+			free(rep);
+			continue;
+		}
+		*lastreply = rep;
+		lastreply = &rep->next;
+	}
+	for (k = 0; k < LatLast; k++)
+		if (!(lat[k] = malloc((total + 1) * sizeof(double))))
+			return 1;
+
+	config_init();
+	iconsize = h->iconsize ? (int)h->iconsize : cfg.iconsize;
+	if (!(convert = icon_converter(&format)))
+		return 1;
+	/* Export to a private file so a running dtray is left alone */
+	if ((fd = mkstemp(shmpath)) < 0) {
+		perror("replay: mkstemp");
+		return 1;
+	}
+	close(fd);
+	cfg.shmpath = shmpath;
+	/* Timers in the core (scroll coalescing, breaker retries) run on
+	 * the trace's clock, not on how fast it is replayed */
+	now_set(EPOCH);
+	if (!watcher_setup(h->host ? &stubbackend : &nullbackend, h->host)) {
+		unlink(shmpath);
+		return 1;
+	}
+
+	start = now();
+	for (off = sizeof(*h); off + sizeof(r) <= len; off += r.len) {
+		memcpy(&r, buf + off, sizeof(r));
+		off += sizeof(r);
+		if (r.len > len - off)
+			break;
+		recorded += r.delta;
+		now_set(EPOCH + (long long)(recorded / 1000));
+		if (r.kind == TraceIn) {
+			if (!(msg = dbus_message_demarshal((char *)buf + off, r.len, &err))) {
+				dbus_error_free(&err);
+				continue;
+			}
+			k = dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_SIGNAL ?
+				LatSignal : LatCall;
+			t = now();
+			incoming = msg;
+			watcher_dispatch();
+		} else if (r.kind == TraceX && r.len > sizeof(TraceXEvent) &&
+		           buf[off + r.len - 1] == '\0') {
+			k = LatX;
+			t = now();
+			replay_x((const TraceXEvent *)(buf + off),
+				(char *)buf + off + sizeof(TraceXEvent));
+			watcher_dispatch();
+		} else
+			continue;
+		lat[k][n[k]++] = now() - t;
+	}
+	elapsed = now() - start;
+
+	total = n[LatCall] + n[LatSignal] + n[LatX];
+	printf("%zu events in %.3fs (recorded over %.3fs): %.0f events/s\n",
+		total, elapsed, recorded / 1e6, elapsed > 0 ? total / elapsed : 0);
+	printf("%lu sent, %lu calls, %lu without a recorded reply\n",
+		nsent, ncalls, nmissed);
+	for (k = 0; k < LatLast; k++)
+		report(names[k], lat[k], n[k]);
+	if (!h->host)
+		null_dump(stdout);
+
+	watcher_cleanup();
+	unlink(shmpath);
+	while ((rep = replies)) {
+		replies = rep->next;
+		dbus_message_unref(rep->msg);
+		free(rep->key);
+		free(rep);
+	}
+	for (i = 0; i < LatLast; i++)
+		free(lat[i]);
+	free(buf);
+	return 0;
+}
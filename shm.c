@@ -0,0 +1,179 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * State export: a seqlock-protected snapshot of the items in a shared
+ * file, see shm.h. Each item slot owns a fixed icon area, so a
+ * snapshot never moves pixels around and untouched areas cost no
+ * memory in tmpfs.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dbus/dbus.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "icon.h"
+#include "dtray.h"
+#include "shm.h"
+
+static ShmState *state;
+static size_t statesize;
+static size_t iconbytes; /* per slot */
+
+static void
+copystr(char *dst, const char *src, size_t n)
+{
+	if (!src)
+		src = "";
+	strncpy(dst, src, n - 1);
+	dst[n - 1] = '\0';
+}
+
+/* Readers retry while seq is odd */
+static void
+begin(void)
+{
+	__atomic_store_n(&state->seq, state->seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+end(void)
+{
+	__atomic_store_n(&state->seq, state->seq + 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+	syscall(SYS_futex, &state->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static void
+clear(int from)
+{
+	for (; from < (int)state->nitems; from++)
+		memset(&state->items[from], 0, sizeof(ShmItem));
+}
+
+/* Open path, relative to $XDG_RUNTIME_DIR unless absolute, refusing
+ * links and files another user planted */
+static int
+openfile(const char *path)
+{
+	char buf[PATH_MAX];
+	const char *dir;
+	struct stat st;
+	int fd;
+
+	if (path[0] != '/') {
+		if (!(dir = getenv("XDG_RUNTIME_DIR")) || !*dir) {
+			fprintf(stderr, "dtray: shm: XDG_RUNTIME_DIR is not set\n");
+			return -1;
+		}
+		snprintf(buf, sizeof(buf), "%s/%s", dir, path);
+		path = buf;
+	}
+	if ((fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0) {
+		perror("dtray: shm");
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid()) {
+		fprintf(stderr, "dtray: shm: %s is not a file of ours\n", path);
+		close(fd);
+		return -1;
+	}
+	if (st.st_mode & 077)
+		fchmod(fd, 0600);
+	return fd;
+}
+
+/* Create or reuse the segment at path; iconmax is the side of the icon
+ * area per item, 0 to leave pixels out. Returns 0 on failure. */
+int
+shm_setup(const char *path, int iconmax)
+{
+	void *p;
+	int fd;
+
+	iconbytes = (size_t)iconmax * iconmax * 4;
+	statesize = sizeof(ShmState) + SHM_ITEMS * iconbytes;
+	if ((fd = openfile(path)) < 0)
+		return 0;
+	if (ftruncate(fd, statesize) < 0 ||
+	    (p = mmap(NULL, statesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror("dtray: shm");
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	/* Continue the sequence of a previous run so its readers notice */
+	state = p;
+	begin();
+	state->nitems = SHM_ITEMS;
+	clear(0);
+	state->nitems = 0;
+	state->magic = SHM_MAGIC;
+	state->version = SHM_VERSION;
+	state->size = statesize;
+	state->iconmax = iconmax;
+	end();
+	return 1;
+}
+
+static void
+fill(ShmItem *s, const Item *item, int slot)
+{
+	memset(s, 0, sizeof(*s));
+	if (!item->service)
+		return;
+	s->used = 1;
+	copystr(s->service, item->service, sizeof(s->service));
+	copystr(s->path, item->path, sizeof(s->path));
+	copystr(s->status, item->text[TextStatus], sizeof(s->status));
+	copystr(s->title, item->text[TextTitle], sizeof(s->title));
+	if (!iconbytes || !item->src.px || (size_t)item->src.w * item->src.h * 4 > iconbytes)
+		return;
+	s->w = item->src.w;
+	s->h = item->src.h;
+	s->icon = sizeof(ShmState) + slot * iconbytes;
+	memcpy((char *)state + s->icon, item->src.px, (size_t)s->w * s->h * 4);
+}
+
+/* Write a new snapshot of items[] and wake readers */
+void
+shm_publish(void)
+{
+	int i, n;
+
+	if (!state)
+		return;
+	n = nitems < SHM_ITEMS ? nitems : SHM_ITEMS;
+	begin();
+	for (i = 0; i < n; i++)
+		fill(&state->items[i], &items[i], i);
+	clear(n);
+	state->nitems = n;
+	end();
+}
+
+/* Leaves the file in place with no items, for readers still mapping it */
+void
+shm_cleanup(void)
+{
+	if (!state)
+		return;
+	begin();
+	clear(0);
+	state->nitems = 0;
+	end();
+	munmap(state, statesize);
+	state = NULL;
+}
@@ -0,0 +1,37 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Layout of the state snapshot dtray publishes at shmpath, by default
+ * $XDG_RUNTIME_DIR/dtray, for status bars and scripts that map it
+ * read-only instead of asking the bus.
+ *
+ * seq is a seqlock: it is odd while dtray writes. A reader loads seq,
+ * retries if odd, copies what it needs, then reloads seq and retries if
+ * it changed. On Linux, dtray wakes futex waiters on seq after each
+ * update, so a reader can sleep in FUTEX_WAIT (not private) on the even
+ * value it last saw.
+ */
+
+#define SHM_MAGIC 0x79617274 /* "tray" in little endian */
+#define SHM_VERSION 1
+#define SHM_ITEMS 64
+#define SHM_STR 128
+
+typedef struct {
+	char service[SHM_STR];
+	char path[SHM_STR];
+	char status[32];      /* Passive, Active or NeedsAttention, "" if unknown */
+	char title[SHM_STR];
+	uint32_t used;        /* slot holds an item */
+	uint32_t w, h;        /* icon size, 0 if none */
+	uint32_t icon;        /* offset of w * h premultiplied ARGB words */
+} ShmItem;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t nitems;      /* slots in use are below this */
+	uint32_t size;        /* bytes mapped */
+	uint32_t iconmax;     /* icon slot side, 0 if icons are not exported */
+	ShmItem items[SHM_ITEMS];
+} ShmState;
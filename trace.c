@@ -0,0 +1,178 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Recording side of the traces described in trace.h. Replies to calls
+ * made with a pending call never pass the connection filters, so the
+ * call is kept on the pending call and recorded with its reply.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dbus/dbus.h>
+
+#include "icon.h"
+#include "dtray.h"
+#include "trace.h"
+
+static FILE *fp;
+static long long last;  /* microseconds */
+static dbus_int32_t slot = -1;
+
+static long long
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int
+trace_open(const char *path, int host)
+{
+	TraceHeader h;
+
+	if (!(fp = fopen(path, "wb"))) {
+		perror("dtray: trace");
+		return 0;
+	}
+	if (!dbus_pending_call_allocate_data_slot(&slot)) {
+		fclose(fp);
+		fp = NULL;
+		return 0;
+	}
+	memset(&h, 0, sizeof(h));
+	h.magic = TRACE_MAGIC;
+	h.version = TRACE_VERSION;
+	h.host = host;
+	h.iconsize = cfg.iconsize;
+	fwrite(&h, sizeof(h), 1, fp);
+	last = now_us();
+	return 1;
+}
+
+int
+trace_active(void)
+{
+	return fp != NULL;
+}
+
+/* What a reply answers: destination, path, member and string arguments,
+ * which tells a Get of IconPixmap from one of Menu */
+void
+trace_key(DBusMessage *call, char *buf, size_t n)
+{
+	DBusMessageIter iter;
+	const char *dest = dbus_message_get_destination(call);
+	const char *path = dbus_message_get_path(call);
+	const char *s;
+	size_t len;
+	int i;
+
+	len = snprintf(buf, n, "%s %s %s", dest ? dest : "", path ? path : "",
+		dbus_message_get_member(call));
+	if (!dbus_message_iter_init(call, &iter))
+		return;
+	for (i = 0; i < 2 && len < n; i++, dbus_message_iter_next(&iter)) {
+		if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+			break;
+		dbus_message_iter_get_basic(&iter, &s);
+		len += snprintf(buf + len, n - len, " %s", s);
+	}
+}
+
+static void
+record(int kind, const void *a, size_t alen, const void *b, size_t blen)
+{
+	TraceRecord r;
+	long long now = now_us();
+
+	memset(&r, 0, sizeof(r));
+	r.kind = kind;
+	r.delta = now - last > UINT32_MAX ? UINT32_MAX : now - last;
+	r.len = alen + blen;
+	last = now;
+	fwrite(&r, sizeof(r), 1, fp);
+	fwrite(a, 1, alen, fp);
+	if (blen)
+		fwrite(b, 1, blen, fp);
+}
+
+static void
+record_msg(int kind, const char *key, DBusMessage *msg)
+{
+	char *buf;
+	int len;
+
+	if (!dbus_message_marshal(msg, &buf, &len))
+		return;
+	if (key)
+		record(kind, key, strlen(key) + 1, buf, len);
+	else
+		record(kind, buf, len, NULL, 0);
+	free(buf);
+}
+
+/* Incoming signals and calls; replies to fire-and-forget sends are
+ * not worth keeping */
+void
+trace_in(DBusMessage *msg)
+{
+	int type = dbus_message_get_type(msg);
+
+	if (fp && (type == DBUS_MESSAGE_TYPE_SIGNAL || type == DBUS_MESSAGE_TYPE_METHOD_CALL))
+		record_msg(TraceIn, NULL, msg);
+}
+
+void
+trace_reply(DBusMessage *call, DBusMessage *reply)
+{
+	char key[TRACE_KEY];
+
+	if (!fp || !call || !reply)
+		return;
+	trace_key(call, key, sizeof(key));
+	record_msg(TraceReply, key, reply);
+}
+
+void
+trace_pending(DBusPendingCall *pending, DBusMessage *call)
+{
+	if (fp && pending)
+		dbus_pending_call_set_data(pending, slot, dbus_message_ref(call),
+			(DBusFreeFunction)dbus_message_unref);
+}
+
+void
+trace_pending_reply(DBusPendingCall *pending, DBusMessage *reply)
+{
+	if (fp)
+		trace_reply(dbus_pending_call_get_data(pending, slot), reply);
+}
+
+void
+trace_x(int what, int button, int a, int b, const char *id)
+{
+	TraceXEvent e;
+
+	if (!fp || !id)
+		return;
+	memset(&e, 0, sizeof(e));
+	e.what = what;
+	e.button = button;
+	e.a = a;
+	e.b = b;
+	record(TraceX, &e, sizeof(e), id, strlen(id) + 1);
+}
+
+void
+trace_close(void)
+{
+	if (!fp)
+		return;
+	fclose(fp);
+	fp = NULL;
+	dbus_pending_call_free_data_slot(&slot);
+}
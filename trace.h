@@ -0,0 +1,51 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Binary trace of what reached dtray, written by dtray -r and fed back
+ * by the replay driver. A TraceHeader is followed by records, each a
+ * TraceRecord and len bytes of payload, in native byte order:
+ *
+ *   TraceIn     a marshalled incoming signal or method call
+ *   TraceReply  a NUL-terminated call key (see trace_key()), then the
+ *               marshalled reply to that call
+ *   TraceX      a TraceXEvent, then the NUL-terminated item id
+ */
+
+#define TRACE_MAGIC 0x63727464 /* "dtrc" in little endian */
+#define TRACE_VERSION 1
+#define TRACE_KEY 512
+
+enum { TraceIn, TraceReply, TraceX, TraceLast };
+enum { XPress, XResize, XMenuClick, XLast };
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t host;    /* recorded as a host, not --watcher-only */
+	uint32_t iconsize;
+} TraceHeader;
+
+typedef struct {
+	uint8_t kind;
+	uint8_t pad[3];
+	uint32_t delta;   /* microseconds since the previous record */
+	uint32_t len;
+} TraceRecord;
+
+/* Input on an item's window, in the item's terms */
+typedef struct {
+	uint8_t what;
+	uint8_t button;
+	uint8_t pad[2];
+	int32_t a, b;     /* root x, y for XPress; width, height for XResize;
+	                   * node id for XMenuClick */
+} TraceXEvent;
+
+int trace_open(const char *path, int host);
+int trace_active(void);
+void trace_key(DBusMessage *call, char *buf, size_t n);
+void trace_in(DBusMessage *msg);
+void trace_reply(DBusMessage *call, DBusMessage *reply);
+void trace_pending(DBusPendingCall *pending, DBusMessage *call);
+void trace_pending_reply(DBusPendingCall *pending, DBusMessage *reply);
+void trace_x(int what, int button, int a, int b, const char *id);
+void trace_close(void);
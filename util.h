@@ -0,0 +1,5 @@
+/* See LICENSE file for copyright and license details. */
+
+void die(const char *fmt, ...);
+long long now_ms(void);
+void now_set(long long ms); /* replay's clock; 0 for the real one */
@@ -0,0 +1,1642 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * StatusNotifierWatcher core: item registry, watcher properties, icon
+ * and menu fetching. Knows nothing about the display; what is shown is
+ * left to the Backend passed to watcher_setup().
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#include "dispatch.h"
+#include "icon.h"
+#include "dtray.h"
+#include "trace.h"
+#include "util.h"
+
+#define MAX_HOSTS 8
+#define WATCHER_PATH "/StatusNotifierWatcher"
+#define PROPS_ALL ((1u << PropLast) - 1)
+
+static const char *introspect_xml =
+	"<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS Object Introspection 1.0//EN\"\n"
+	"\"http://www.freedesktop.org/standards/dbus/1.0/introspect.dtd\">\n"
+	"<node>\n"
+	"  <interface name=\"org.kde.StatusNotifierWatcher\">\n"
+	"    <method name=\"RegisterStatusNotifierItem\">\n"
+	"      <arg direction=\"in\" name=\"service\" type=\"s\"/>\n"
+	"    </method>\n"
+	"    <method name=\"RegisterStatusNotifierHost\">\n"
+	"      <arg direction=\"in\" name=\"service\" type=\"s\"/>\n"
+	"    </method>\n"
+	"    <property name=\"IsStatusNotifierHostRegistered\" type=\"b\" access=\"read\"/>\n"
+	"    <property name=\"ProtocolVersion\" type=\"i\" access=\"read\"/>\n"
+	"    <property name=\"RegisteredStatusNotifierItems\" type=\"as\" access=\"read\"/>\n"
+	"    <signal name=\"StatusNotifierItemRegistered\">\n"
+	"      <arg type=\"s\"/>\n"
+	"    </signal>\n"
+	"    <signal name=\"StatusNotifierItemUnregistered\">\n"
+	"      <arg type=\"s\"/>\n"
+	"    </signal>\n"
+	"    <signal name=\"StatusNotifierHostRegistered\"/>\n"
+	"  </interface>\n"
+	"  <interface name=\"org.freedesktop.DBus.Properties\">\n"
+	"    <method name=\"Get\">\n"
+	"      <arg direction=\"in\" name=\"interface\" type=\"s\"/>\n"
+	"      <arg direction=\"in\" name=\"property\" type=\"s\"/>\n"
+	"      <arg direction=\"out\" name=\"value\" type=\"v\"/>\n"
+	"    </method>\n"
+	"    <method name=\"GetAll\">\n"
+	"      <arg direction=\"in\" name=\"interface\" type=\"s\"/>\n"
+	"      <arg direction=\"out\" name=\"properties\" type=\"a{sv}\"/>\n"
+	"    </method>\n"
+	"  </interface>\n"
+	"  <interface name=\"org.freedesktop.DBus.Introspectable\">\n"
+	"    <method name=\"Introspect\">\n"
+	"      <arg direction=\"out\" name=\"xml\" type=\"s\"/>\n"
+	"    </method>\n"
+	"  </interface>\n"
+	"</node>\n";
+
+Item items[MAX_ITEMS];
+int nitems = 0;
+
+static const Backend *backend;
+static int host;               /* we show items ourselves */
+static char *hosts[MAX_HOSTS]; /* other hosts, by bus name */
+static int nhosts;
+static DBusConnection *conn;
+static long long last_scroll;
+static DBusMessage *getreply[PropLast]; /* prebuilt Get replies */
+static DBusMessage *getallreply;        /* prebuilt GetAll reply */
+static DBusMessage *announced[PropLast]; /* Get replies as last announced */
+static int exporting;                   /* shm snapshot is set up */
+static int exporticons;                 /* and carries pixels */
+static int dirty;                       /* snapshot is out of date */
+static unsigned int propsstale;         /* templates to rebuild */
+static unsigned int propschanged;       /* to announce at the end of the iteration */
+
+static int
+health_timeout(Health *h)
+{
+	int t;
+
+	if (!h->latency)
+		return cfg.timeoutmax;
+	t = h->latency * cfg.timeoutfactor;
+	if (t < cfg.timeoutmin)
+		t = cfg.timeoutmin;
+	if (t > cfg.timeoutmax)
+		t = cfg.timeoutmax;
+	return t;
+}
+
+/* Returns 1 if a call may be made; an open breaker lets a single probe
+ * through once its backoff has expired. */
+static int
+health_admit(Health *h)
+{
+	if (h->state != BreakerOpen)
+		return 1;
+	if (now_ms() < h->retry)
+		return 0;
+	h->state = BreakerHalfOpen;
+	return 1;
+}
+
+/* ms is the round trip, or for a failure the timeout that expired, so
+ * a slow item's timeout can grow again */
+static void
+health_record(Health *h, int ok, int ms)
+{
+	if (ok) {
+		h->latency = h->latency ? (h->latency * 7 + ms) / 8 : (ms > 0 ? ms : 1);
+		h->failures = 0;
+		h->state = BreakerClosed;
+		h->backoff = 0;
+		h->nok++;
+		return;
+	}
+
+	h->failures++;
+	h->nfail++;
+	if (ms > h->latency)
+		h->latency = ms;
+	if (h->state == BreakerHalfOpen) {
+		h->backoff = h->backoff * 2 > cfg.breakeropenmax ? cfg.breakeropenmax : h->backoff * 2;
+	} else if (h->failures >= cfg.breakerfailures) {
+		h->backoff = cfg.breakeropen;
+	} else {
+		return;
+	}
+	h->state = BreakerOpen;
+	h->retry = now_ms() + h->backoff;
+}
+
+static Item *
+find_item(const char *service)
+{
+	int i;
+	for (i = 0; i < nitems; i++) {
+		if (items[i].service && strcmp(items[i].service, service) == 0)
+			return &items[i];
+	}
+	return NULL;
+}
+
+/* Append the value of a watcher property as a variant */
+static void
+append_prop(DBusMessageIter *iter, int prop)
+{
+	DBusMessageIter variant, arr;
+	dbus_bool_t host_reg = host || nhosts;
+	int proto_ver = 0;
+	int i;
+
+	switch (prop) {
+	case PropHostRegistered:
+		dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "b", &variant);
+		dbus_message_iter_append_basic(&variant, DBUS_TYPE_BOOLEAN, &host_reg);
+		break;
+	case PropProtocolVersion:
+		dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "i", &variant);
+		dbus_message_iter_append_basic(&variant, DBUS_TYPE_INT32, &proto_ver);
+		break;
+	case PropItems:
+		dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "as", &variant);
+		dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "s", &arr);
+		for (i = 0; i < nitems; i++)
+			if (items[i].id)
+				dbus_message_iter_append_basic(&arr, DBUS_TYPE_STRING, &items[i].id);
+		dbus_message_iter_close_container(&variant, &arr);
+		break;
+	}
+	dbus_message_iter_close_container(iter, &variant);
+}
+
+/* Append an a{sv} holding the properties in mask */
+static void
+append_props(DBusMessageIter *iter, unsigned int mask)
+{
+	DBusMessageIter dict, entry;
+	const char *name;
+	int i;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+	for (i = 0; i < PropLast; i++) {
+		if (!(mask & 1u << i))
+			continue;
+		dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+		name = dispatch_propname(i);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &name);
+		append_prop(&entry, i);
+		dbus_message_iter_close_container(&dict, &entry);
+	}
+	dbus_message_iter_close_container(iter, &dict);
+}
+
+/* Rebuild the Get templates of the properties in mask and the GetAll
+ * one. Replies are then served by copying. */
+static void
+props_build(unsigned int mask)
+{
+	DBusMessageIter iter;
+	int i;
+
+	for (i = 0; i < PropLast; i++) {
+		if (!(mask & 1u << i))
+			continue;
+		if (getreply[i])
+			dbus_message_unref(getreply[i]);
+		if ((getreply[i] = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN))) {
+			dbus_message_iter_init_append(getreply[i], &iter);
+			append_prop(&iter, i);
+		}
+	}
+
+	if (getallreply)
+		dbus_message_unref(getallreply);
+	if ((getallreply = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN))) {
+		dbus_message_iter_init_append(getallreply, &iter);
+		append_props(&iter, PROPS_ALL);
+	}
+}
+
+/* A property changed. Templates are rebuilt when next needed and
+ * listeners told once per loop iteration, however many changes. */
+static void
+props_changed(int prop)
+{
+	propsstale |= 1u << prop;
+	propschanged |= 1u << prop;
+}
+
+static void
+props_sync(void)
+{
+	if (propsstale)
+		props_build(propsstale);
+	propsstale = 0;
+}
+
+/* Returns 1 unless a and b marshal to the same bytes */
+static int
+props_differ(DBusMessage *a, DBusMessage *b)
+{
+	char *abuf, *bbuf;
+	int alen, blen, ret = 1;
+
+	if (!a || !b || !dbus_message_marshal(a, &abuf, &alen))
+		return 1;
+	if (dbus_message_marshal(b, &bbuf, &blen)) {
+		ret = alen != blen || memcmp(abuf, bbuf, alen) != 0;
+		free(bbuf);
+	}
+	free(abuf);
+	return ret;
+}
+
+static void
+props_announce(unsigned int mask)
+{
+	int i;
+
+	for (i = 0; i < PropLast; i++) {
+		if (!(mask & 1u << i))
+			continue;
+		if (announced[i])
+			dbus_message_unref(announced[i]);
+		announced[i] = getreply[i] ? dbus_message_ref(getreply[i]) : NULL;
+	}
+}
+
+/* Announce what changed this iteration, behind the Registered and
+ * Unregistered signals out.c batched for it */
+static void
+props_flush(void)
+{
+	DBusMessage *sig;
+	DBusMessageIter iter, arr;
+	const char *iface = WATCHER_IFACE;
+	int i;
+
+	props_sync();
+	/* A register and unregister that cancelled out change nothing */
+	for (i = 0; i < PropLast; i++)
+		if (propschanged & 1u << i && !props_differ(announced[i], getreply[i]))
+			propschanged &= ~(1u << i);
+	if (!propschanged)
+		return;
+	sig = dbus_message_new_signal(WATCHER_PATH, PROP_IFACE, "PropertiesChanged");
+	if (sig) {
+		dbus_message_iter_init_append(sig, &iter);
+		dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &iface);
+		append_props(&iter, propschanged);
+		dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &arr);
+		dbus_message_iter_close_container(&iter, &arr);
+		out_broadcast(sig);
+		dbus_message_unref(sig);
+	}
+	props_announce(propschanged);
+	propschanged = 0;
+}
+
+static void
+props_free(void)
+{
+	int i;
+
+	for (i = 0; i < PropLast; i++) {
+		if (getreply[i])
+			dbus_message_unref(getreply[i]);
+		if (announced[i])
+			dbus_message_unref(announced[i]);
+		getreply[i] = announced[i] = NULL;
+	}
+	if (getallreply)
+		dbus_message_unref(getallreply);
+	getallreply = NULL;
+}
+
+void
+activate_item(Item *item, int x, int y)
+{
+	DBusMessage *msg;
+
+	if (!item || !item->service || !item->path)
+		return;
+
+	msg = dbus_message_new_method_call(item->service, item->path, ITEM_IFACE, "Activate");
+	if (msg) {
+		dbus_message_append_args(msg, DBUS_TYPE_INT32, &x, DBUS_TYPE_INT32, &y, DBUS_TYPE_INVALID);
+		out_send(msg);
+		dbus_message_unref(msg);
+	}
+}
+
+/* For apps without a dbusmenu, or backends that cannot show one */
+void
+context_menu(Item *item, int x, int y)
+{
+	DBusMessage *msg;
+
+	if (!item || !item->service || !item->path)
+		return;
+
+	msg = dbus_message_new_method_call(item->service, item->path, ITEM_IFACE, "ContextMenu");
+	if (msg) {
+		dbus_message_append_args(msg, DBUS_TYPE_INT32, &x, DBUS_TYPE_INT32, &y, DBUS_TYPE_INVALID);
+		out_send(msg);
+		dbus_message_unref(msg);
+	}
+}
+
+void
+secondary_activate(Item *item, int x, int y)
+{
+	DBusMessage *msg;
+
+	if (!item || !item->service || !item->path)
+		return;
+
+	msg = dbus_message_new_method_call(item->service, item->path, ITEM_IFACE, "SecondaryActivate");
+	if (msg) {
+		dbus_message_append_args(msg, DBUS_TYPE_INT32, &x, DBUS_TYPE_INT32, &y, DBUS_TYPE_INVALID);
+		out_send(msg);
+		dbus_message_unref(msg);
+	}
+}
+
+static void
+scroll_item(Item *item, int delta, const char *orientation)
+{
+	DBusMessage *msg;
+
+	if (!item || !item->service || !item->path)
+		return;
+
+	msg = dbus_message_new_method_call(item->service, item->path, ITEM_IFACE, "Scroll");
+	if (msg) {
+		dbus_message_append_args(msg, DBUS_TYPE_INT32, &delta,
+			DBUS_TYPE_STRING, &orientation, DBUS_TYPE_INVALID);
+		out_send(msg);
+		dbus_message_unref(msg);
+	}
+}
+
+/* Send the wheel steps accumulated since the last flush as at most one
+ * Scroll call per item and orientation. Returns the number of
+ * milliseconds until the next flush is due, or -1 if nothing is pending. */
+static int
+flush_scroll(void)
+{
+	long long now = now_ms();
+	int i, pending = 0;
+
+	for (i = 0; i < nitems; i++)
+		if (items[i].scroll_dx || items[i].scroll_dy)
+			pending = 1;
+	if (!pending)
+		return -1;
+	if (now - last_scroll < cfg.scrollinterval)
+		return cfg.scrollinterval - (int)(now - last_scroll);
+
+	for (i = 0; i < nitems; i++) {
+		if (items[i].scroll_dy)
+			scroll_item(&items[i], items[i].scroll_dy, "vertical");
+		if (items[i].scroll_dx)
+			scroll_item(&items[i], items[i].scroll_dx, "horizontal");
+		items[i].scroll_dx = 0;
+		items[i].scroll_dy = 0;
+	}
+	last_scroll = now;
+	return -1;
+}
+
+void
+fetch_icon(Item *item)
+{
+	DBusMessage *msg, *reply;
+	DBusMessageIter iter, variant, arr, st;
+	DBusError err;
+	IconEntry entries[ICON_MAXENTRIES];
+	int nentries = 0;
+	Image src;
+	long long start;
+	int timeout;
+
+	if (!item || !item->service || !item->path)
+		return;
+
+	/* While the breaker is open the last good icon stays up */
+	if (!health_admit(&item->health))
+		return;
+
+	dbus_error_init(&err);
+
+	msg = dbus_message_new_method_call(item->service, item->path, PROP_IFACE, "Get");
+	if (!msg)
+		return;
+
+	const char *iface = ITEM_IFACE;
+	const char *prop = "IconPixmap";
+	dbus_message_append_args(msg,
+		DBUS_TYPE_STRING, &iface,
+		DBUS_TYPE_STRING, &prop,
+		DBUS_TYPE_INVALID);
+
+	start = now_ms();
+	timeout = health_timeout(&item->health);
+	lag_enter("fetch_icon", item);
+	reply = dbus_connection_send_with_reply_and_block(conn, msg, timeout, &err);
+	lag_leave();
+	trace_reply(msg, reply);
+	dbus_message_unref(msg);
+
+	/* Only silence counts against the item; an error reply, such as
+	 * UnknownProperty from an app with just IconName, is a quick answer */
+	if (dbus_error_is_set(&err)) {
+		if (dbus_error_has_name(&err, DBUS_ERROR_NO_REPLY) ||
+		    dbus_error_has_name(&err, DBUS_ERROR_TIMEOUT)) {
+			health_record(&item->health, 0, timeout);
+		} else {
+			health_record(&item->health, 1, (int)(now_ms() - start));
+			item->iconstale = 0;
+		}
+		dbus_error_free(&err);
+		return;
+	}
+	if (!reply)
+		return;
+	health_record(&item->health, 1, (int)(now_ms() - start));
+	item->iconstale = 0;
+
+	if (!dbus_message_iter_init(reply, &iter)) {
+		dbus_message_unref(reply);
+		return;
+	}
+
+	if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT) {
+		dbus_message_unref(reply);
+		return;
+	}
+
+	dbus_message_iter_recurse(&iter, &variant);
+	if (dbus_message_iter_get_arg_type(&variant) != DBUS_TYPE_ARRAY) {
+		dbus_message_unref(reply);
+		return;
+	}
+
+	dbus_message_iter_recurse(&variant, &arr);
+	while (dbus_message_iter_get_arg_type(&arr) == DBUS_TYPE_STRUCT &&
+	       nentries < ICON_MAXENTRIES) {
+		int w, h, len;
+		unsigned char *data;
+		DBusMessageIter data_iter;
+
+		dbus_message_iter_recurse(&arr, &st);
+
+		if (dbus_message_iter_get_arg_type(&st) != DBUS_TYPE_INT32)
+			goto next;
+		dbus_message_iter_get_basic(&st, &w);
+		dbus_message_iter_next(&st);
+
+		if (dbus_message_iter_get_arg_type(&st) != DBUS_TYPE_INT32)
+			goto next;
+		dbus_message_iter_get_basic(&st, &h);
+		dbus_message_iter_next(&st);
+
+		if (dbus_message_iter_get_arg_type(&st) != DBUS_TYPE_ARRAY)
+			goto next;
+
+		dbus_message_iter_recurse(&st, &data_iter);
+		dbus_message_iter_get_fixed_array(&data_iter, &data, &len);
+
+		/* Validated and chosen from by icon_decode() */
+		entries[nentries].w = w;
+		entries[nentries].h = h;
+		entries[nentries].data = data;
+		entries[nentries].len = len > 0 ? len : 0;
+		nentries++;
+next:
+		dbus_message_iter_next(&arr);
+	}
+
+	if (icon_decode(&src, entries, nentries, cfg.iconsrcmax)) {
+		icon_free(&item->src);
+		item->src = src;
+		dirty = 1;
+		if (backend->icon) {
+			lag_enter("backend icon", item);
+			backend->icon(item);
+			lag_leave();
+		}
+	}
+
+	dbus_message_unref(reply);
+}
+
+/* The app has a new icon. Its pixels are only fetched when something
+ * will use them: the backend shows the item, or the snapshot exports
+ * icons; otherwise the backend fetches them once it shows the item. */
+static void
+icon_changed(Item *item)
+{
+	item->iconstale = 1;
+	if (exporticons || !backend->shown || backend->shown(item))
+		fetch_icon(item);
+}
+
+static void
+menu_free(MenuNode *n)
+{
+	int i;
+
+	if (!n)
+		return;
+	for (i = 0; i < n->nchildren; i++)
+		menu_free(n->children[i]);
+	free(n->children);
+	free(n->label);
+	free(n);
+}
+
+MenuNode *
+menu_find(MenuNode *n, int id)
+{
+	MenuNode *r;
+	int i;
+
+	if (!n)
+		return NULL;
+	if (n->id == id)
+		return n;
+	for (i = 0; i < n->nchildren; i++)
+		if ((r = menu_find(n->children[i], id)))
+			return r;
+	return NULL;
+}
+
+static void
+menu_set_label(MenuNode *n, const char *s)
+{
+	char *d;
+
+	free(n->label);
+	if (!(n->label = d = malloc(strlen(s) + 1)))
+		return;
+	/* Drop mnemonic markers: "_File" -> "File", "__" -> "_" */
+	for (; *s; s++) {
+		if (*s == '_' && *++s == '\0')
+			break;
+		*d++ = *s;
+	}
+	*d = '\0';
+}
+
+static void
+menu_set_prop(MenuNode *n, const char *name, DBusMessageIter *val)
+{
+	const char *s;
+	dbus_bool_t b;
+	int i;
+
+	switch (dbus_message_iter_get_arg_type(val)) {
+	case DBUS_TYPE_STRING:
+		dbus_message_iter_get_basic(val, &s);
+		if (strcmp(name, "label") == 0)
+			menu_set_label(n, s);
+		else if (strcmp(name, "type") == 0)
+			n->separator = strcmp(s, "separator") == 0;
+		else if (strcmp(name, "toggle-type") == 0)
+			n->toggle = strcmp(s, "checkmark") == 0 ? ToggleCheck :
+				strcmp(s, "radio") == 0 ? ToggleRadio : ToggleNone;
+		else if (strcmp(name, "children-display") == 0)
+			n->submenu = strcmp(s, "submenu") == 0;
+		break;
+	case DBUS_TYPE_BOOLEAN:
+		dbus_message_iter_get_basic(val, &b);
+		if (strcmp(name, "enabled") == 0)
+			n->enabled = b;
+		else if (strcmp(name, "visible") == 0)
+			n->visible = b;
+		break;
+	case DBUS_TYPE_INT32:
+		dbus_message_iter_get_basic(val, &i);
+		if (strcmp(name, "toggle-state") == 0)
+			n->toggled = i == 1;
+		break;
+	}
+}
+
+static void
+menu_reset_prop(MenuNode *n, const char *name)
+{
+	if (strcmp(name, "label") == 0) {
+		free(n->label);
+		n->label = NULL;
+	} else if (strcmp(name, "type") == 0) {
+		n->separator = 0;
+	} else if (strcmp(name, "toggle-type") == 0) {
+		n->toggle = ToggleNone;
+	} else if (strcmp(name, "toggle-state") == 0) {
+		n->toggled = 0;
+	} else if (strcmp(name, "children-display") == 0) {
+		n->submenu = 0;
+	} else if (strcmp(name, "enabled") == 0) {
+		n->enabled = 1;
+	} else if (strcmp(name, "visible") == 0) {
+		n->visible = 1;
+	}
+}
+
+/* Apply an a{sv} property dictionary to a node */
+static void
+menu_props(MenuNode *n, DBusMessageIter *arr)
+{
+	DBusMessageIter entry, var;
+	const char *name;
+
+	for (; dbus_message_iter_get_arg_type(arr) == DBUS_TYPE_DICT_ENTRY;
+	     dbus_message_iter_next(arr)) {
+		dbus_message_iter_recurse(arr, &entry);
+		if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_STRING)
+			continue;
+		dbus_message_iter_get_basic(&entry, &name);
+		dbus_message_iter_next(&entry);
+		if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_VARIANT)
+			continue;
+		dbus_message_iter_recurse(&entry, &var);
+		menu_set_prop(n, name, &var);
+	}
+}
+
+/* Parse a (ia{sv}av) layout node */
+static MenuNode *
+menu_parse(DBusMessageIter *it, int depth)
+{
+	DBusMessageIter st, sub, var;
+	MenuNode *n, *c, **tmp;
+
+	if (depth >= MENU_DEPTH || dbus_message_iter_get_arg_type(it) != DBUS_TYPE_STRUCT)
+		return NULL;
+	dbus_message_iter_recurse(it, &st);
+	if (dbus_message_iter_get_arg_type(&st) != DBUS_TYPE_INT32)
+		return NULL;
+	if (!(n = calloc(1, sizeof(*n))))
+		return NULL;
+	n->enabled = 1;
+	n->visible = 1;
+	dbus_message_iter_get_basic(&st, &n->id);
+	dbus_message_iter_next(&st);
+
+	if (dbus_message_iter_get_arg_type(&st) == DBUS_TYPE_ARRAY) {
+		dbus_message_iter_recurse(&st, &sub);
+		menu_props(n, &sub);
+	}
+	dbus_message_iter_next(&st);
+
+	if (dbus_message_iter_get_arg_type(&st) != DBUS_TYPE_ARRAY)
+		return n;
+	dbus_message_iter_recurse(&st, &sub);
+	for (; dbus_message_iter_get_arg_type(&sub) == DBUS_TYPE_VARIANT;
+	     dbus_message_iter_next(&sub)) {
+		dbus_message_iter_recurse(&sub, &var);
+		if (!(c = menu_parse(&var, depth + 1)))
+			continue;
+		if (!(tmp = realloc(n->children, (n->nchildren + 1) * sizeof(*tmp)))) {
+			menu_free(c);
+			break;
+		}
+		n->children = tmp;
+		n->children[n->nchildren++] = c;
+	}
+	return n;
+}
+
+static void menu_reply(DBusPendingCall *pending, void *data);
+
+static void
+menu_call(Item *item, DBusMessage *msg)
+{
+	if (!msg)
+		return;
+	if (dbus_connection_send_with_reply(conn, msg, &item->menu_call,
+	    health_timeout(&item->health)) && item->menu_call) {
+		dbus_pending_call_set_notify(item->menu_call, menu_reply, item, NULL);
+		trace_pending(item->menu_call, msg);
+	}
+	dbus_message_unref(msg);
+}
+
+/* Ask for the item's Menu property; the layout is fetched once it arrives */
+static void
+menu_request(Item *item)
+{
+	DBusMessage *msg;
+	const char *iface = ITEM_IFACE;
+	const char *prop = "Menu";
+
+	msg = dbus_message_new_method_call(item->service, item->path, PROP_IFACE, "Get");
+	if (msg)
+		dbus_message_append_args(msg,
+			DBUS_TYPE_STRING, &iface,
+			DBUS_TYPE_STRING, &prop,
+			DBUS_TYPE_INVALID);
+	menu_call(item, msg);
+}
+
+/* Fetch the subtree below parent, or queue it behind a call in flight */
+static void
+menu_fetch(Item *item, int parent)
+{
+	static const char *props[] = {
+		"label", "enabled", "visible", "type",
+		"toggle-type", "toggle-state", "children-display"
+	};
+	const char **p = props;
+	int n = sizeof(props) / sizeof(props[0]);
+	int depth = -1;
+	DBusMessage *msg;
+
+	if (item->menu_call) {
+		item->menu_stale = item->menu_stale < 0 || item->menu_stale == parent ? parent : 0;
+		return;
+	}
+
+	msg = dbus_message_new_method_call(item->menu_owner, item->menu, DBUSMENU_IFACE, "GetLayout");
+	if (msg)
+		dbus_message_append_args(msg,
+			DBUS_TYPE_INT32, &parent,
+			DBUS_TYPE_INT32, &depth,
+			DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &p, n,
+			DBUS_TYPE_INVALID);
+	menu_call(item, msg);
+}
+
+static void
+menu_got_path(Item *item, DBusMessage *reply)
+{
+	DBusMessageIter iter, variant;
+	const char *path, *sender;
+
+	if (!dbus_message_iter_init(reply, &iter) ||
+	    dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT)
+		return;
+	dbus_message_iter_recurse(&iter, &variant);
+	if (dbus_message_iter_get_arg_type(&variant) != DBUS_TYPE_OBJECT_PATH)
+		return;
+	dbus_message_iter_get_basic(&variant, &path);
+	if (strcmp(path, "/") == 0)
+		return;
+
+	/* Signals come from the unique name, which the reply carries */
+	sender = dbus_message_get_sender(reply);
+	item->menu = strdup(path);
+	item->menu_owner = strdup(sender ? sender : item->service);
+	item->menu_stale = 0;
+}
+
+static void
+menu_got_layout(Item *item, DBusMessage *reply)
+{
+	DBusMessageIter iter;
+	MenuNode *n, *old;
+	MenuNode **children;
+	int nchildren;
+
+	if (!dbus_message_iter_init(reply, &iter) ||
+	    dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_UINT32)
+		return;
+	dbus_message_iter_next(&iter);
+	if (!(n = menu_parse(&iter, 0)))
+		return;
+
+	if (!item->layout || n->id == item->layout->id) {
+		menu_free(item->layout);
+		item->layout = n;
+	} else if ((old = menu_find(item->layout, n->id))) {
+		/* Splice the new subtree into the cached node in place */
+		children = old->children;
+		nchildren = old->nchildren;
+		old->children = n->children;
+		old->nchildren = n->nchildren;
+		n->children = children;
+		n->nchildren = nchildren;
+		free(old->label);
+		old->label = n->label;
+		n->label = NULL;
+		old->enabled = n->enabled;
+		old->visible = n->visible;
+		old->separator = n->separator;
+		old->toggle = n->toggle;
+		old->toggled = n->toggled;
+		old->submenu = n->submenu;
+		menu_free(n);
+	} else {
+		menu_free(n);
+		item->menu_stale = 0;
+	}
+
+	if (backend->menu)
+		backend->menu(item);
+}
+
+static void
+menu_reply(DBusPendingCall *pending, void *data)
+{
+	Item *item = data;
+	DBusMessage *reply;
+	int parent;
+
+	reply = dbus_pending_call_steal_reply(pending);
+	trace_pending_reply(pending, reply);
+	dbus_pending_call_unref(pending);
+	item->menu_call = NULL;
+
+	if (reply) {
+		if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+			if (!item->menu)
+				menu_got_path(item, reply);
+			else
+				menu_got_layout(item, reply);
+		}
+		dbus_message_unref(reply);
+	}
+
+	if (item->menu && item->menu_stale >= 0) {
+		parent = item->menu_stale;
+		item->menu_stale = -1;
+		menu_fetch(item, parent);
+	}
+}
+
+/* ItemsPropertiesUpdated(a(ia{sv}) updated, a(ias) removed) */
+static void
+menu_props_updated(Item *item, DBusMessage *msg)
+{
+	DBusMessageIter iter, arr, st, sub;
+	MenuNode *n;
+	const char *name;
+	int id;
+
+	if (!item->layout || !dbus_message_iter_init(msg, &iter))
+		return;
+
+	if (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_ARRAY) {
+		dbus_message_iter_recurse(&iter, &arr);
+		for (; dbus_message_iter_get_arg_type(&arr) == DBUS_TYPE_STRUCT;
+		     dbus_message_iter_next(&arr)) {
+			dbus_message_iter_recurse(&arr, &st);
+			if (dbus_message_iter_get_arg_type(&st) != DBUS_TYPE_INT32)
+				continue;
+			dbus_message_iter_get_basic(&st, &id);
+			dbus_message_iter_next(&st);
+			if (!(n = menu_find(item->layout, id)) ||
+			    dbus_message_iter_get_arg_type(&st) != DBUS_TYPE_ARRAY)
+				continue;
+			dbus_message_iter_recurse(&st, &sub);
+			menu_props(n, &sub);
+		}
+	}
+	dbus_message_iter_next(&iter);
+
+	if (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_ARRAY) {
+		dbus_message_iter_recurse(&iter, &arr);
+		for (; dbus_message_iter_get_arg_type(&arr) == DBUS_TYPE_STRUCT;
+		     dbus_message_iter_next(&arr)) {
+			dbus_message_iter_recurse(&arr, &st);
+			if (dbus_message_iter_get_arg_type(&st) != DBUS_TYPE_INT32)
+				continue;
+			dbus_message_iter_get_basic(&st, &id);
+			dbus_message_iter_next(&st);
+			if (!(n = menu_find(item->layout, id)) ||
+			    dbus_message_iter_get_arg_type(&st) != DBUS_TYPE_ARRAY)
+				continue;
+			dbus_message_iter_recurse(&st, &sub);
+			for (; dbus_message_iter_get_arg_type(&sub) == DBUS_TYPE_STRING;
+			     dbus_message_iter_next(&sub)) {
+				dbus_message_iter_get_basic(&sub, &name);
+				menu_reset_prop(n, name);
+			}
+		}
+	}
+
+	if (backend->menu)
+		backend->menu(item);
+}
+
+static void
+menu_clear(Item *item)
+{
+	if (item->menu_call) {
+		dbus_pending_call_cancel(item->menu_call);
+		dbus_pending_call_unref(item->menu_call);
+		item->menu_call = NULL;
+	}
+	menu_free(item->layout);
+	free(item->menu);
+	free(item->menu_owner);
+	item->layout = NULL;
+	item->menu = NULL;
+	item->menu_owner = NULL;
+	item->menu_stale = -1;
+}
+
+static Item *
+find_item_by_menu(const char *sender, const char *path)
+{
+	int i;
+
+	if (!sender || !path)
+		return NULL;
+	for (i = 0; i < nitems; i++) {
+		if (items[i].menu && strcmp(items[i].menu_owner, sender) == 0 &&
+		    strcmp(items[i].menu, path) == 0)
+			return &items[i];
+	}
+	return NULL;
+}
+
+/* Call on a shown menu; never waits for the app, but out.c holds back
+ * events to one that stops answering */
+void
+menu_notify(Item *item, int id, const char *event, unsigned long time)
+{
+	DBusMessage *msg;
+	DBusMessageIter iter, var;
+	dbus_uint32_t ts = time;
+	int zero = 0;
+
+	if (!item->menu)
+		return;
+	msg = dbus_message_new_method_call(item->menu_owner, item->menu,
+		DBUSMENU_IFACE, event ? "Event" : "AboutToShow");
+	if (!msg)
+		return;
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_INT32, &id);
+	if (event) {
+		dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &event);
+		dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT, "i", &var);
+		dbus_message_iter_append_basic(&var, DBUS_TYPE_INT32, &zero);
+		dbus_message_iter_close_container(&iter, &var);
+		dbus_message_iter_append_basic(&iter, DBUS_TYPE_UINT32, &ts);
+	}
+	out_send(msg);
+	dbus_message_unref(msg);
+}
+
+static void
+text_set(Item *item, int which, const char *s)
+{
+	if (item->text[which] && strcmp(item->text[which], s) == 0)
+		return;
+	free(item->text[which]);
+	item->text[which] = strdup(s);
+	dirty = 1;
+}
+
+static void
+text_reply(DBusPendingCall *pending, void *data)
+{
+	Item *item = data;
+	DBusMessage *reply;
+	DBusMessageIter iter, variant;
+	const char *s;
+	int i;
+
+	for (i = 0; i < TextLast && item->text_call[i] != pending; i++)
+		;
+	reply = dbus_pending_call_steal_reply(pending);
+	trace_pending_reply(pending, reply);
+	dbus_pending_call_unref(pending);
+	if (i < TextLast)
+		item->text_call[i] = NULL;
+	if (!reply)
+		return;
+
+	if (i < TextLast && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+	    dbus_message_iter_init(reply, &iter) &&
+	    dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_VARIANT) {
+		dbus_message_iter_recurse(&iter, &variant);
+		if (dbus_message_iter_get_arg_type(&variant) == DBUS_TYPE_STRING) {
+			dbus_message_iter_get_basic(&variant, &s);
+			text_set(item, i, s);
+		}
+	}
+	dbus_message_unref(reply);
+}
+
+/* Ask for Status or Title without waiting; only the snapshot needs them */
+static void
+text_fetch(Item *item, int which)
+{
+	static const char *props[TextLast] = { "Status", "Title" };
+	DBusMessage *msg;
+	const char *iface = ITEM_IFACE;
+
+	if (!exporting || item->text_call[which] || item->health.state == BreakerOpen)
+		return;
+	msg = dbus_message_new_method_call(item->service, item->path, PROP_IFACE, "Get");
+	if (!msg)
+		return;
+	dbus_message_append_args(msg,
+		DBUS_TYPE_STRING, &iface,
+		DBUS_TYPE_STRING, &props[which],
+		DBUS_TYPE_INVALID);
+	if (dbus_connection_send_with_reply(conn, msg, &item->text_call[which],
+	    health_timeout(&item->health)) && item->text_call[which]) {
+		dbus_pending_call_set_notify(item->text_call[which], text_reply, item, NULL);
+		trace_pending(item->text_call[which], msg);
+	}
+	dbus_message_unref(msg);
+}
+
+static void
+text_clear(Item *item)
+{
+	int i;
+
+	for (i = 0; i < TextLast; i++) {
+		if (item->text_call[i]) {
+			dbus_pending_call_cancel(item->text_call[i]);
+			dbus_pending_call_unref(item->text_call[i]);
+			item->text_call[i] = NULL;
+		}
+		free(item->text[i]);
+		item->text[i] = NULL;
+	}
+}
+
+static void
+add_item(const char *service, const char *path)
+{
+	Item *item;
+	int i;
+
+	if (nitems >= MAX_ITEMS) {
+		fprintf(stderr, "dtray: max items reached\n");
+		return;
+	}
+
+	/* Check if already exists */
+	if (find_item(service))
+		return;
+
+	/* Find empty slot */
+	for (i = 0; i < MAX_ITEMS; i++) {
+		if (!items[i].service)
+			break;
+	}
+
+	item = &items[i];
+	item->service = strdup(service);
+	item->path = strdup(path);
+	if ((item->id = malloc(strlen(service) + strlen(path) + 1)))
+		sprintf(item->id, "%s%s", service, path);
+	memset(&item->src, 0, sizeof(item->src));
+	item->scroll_dx = 0;
+	item->scroll_dy = 0;
+	memset(&item->health, 0, sizeof(item->health));
+	item->menu = NULL;
+	item->menu_owner = NULL;
+	item->layout = NULL;
+	item->menu_call = NULL;
+	item->menu_stale = -1;
+	memset(item->text, 0, sizeof(item->text));
+	memset(item->text_call, 0, sizeof(item->text_call));
+	item->iconstale = 0;
+	item->priv = NULL;
+
+	if (i >= nitems)
+		nitems = i + 1;
+	dirty = 1;
+
+	if (backend->add) {
+		lag_enter("backend add", item);
+		backend->add(item);
+		lag_leave();
+	}
+
+	/* A watcher for other hosts leaves icons and menus to them */
+	if (host) {
+		icon_changed(item);
+		/* Prefetch the menu so right-click needs no round trip */
+		menu_request(item);
+	}
+	text_fetch(item, TextStatus);
+	text_fetch(item, TextTitle);
+
+	/* Send signal that item was registered */
+	if (item->id)
+		out_signal(OutRegistered, item->id);
+	props_changed(PropItems);
+}
+
+static void
+remove_item(const char *service)
+{
+	Item *item = find_item(service);
+
+	if (!item)
+		return;
+
+	if (item->id)
+		out_signal(OutUnregistered, item->id);
+
+	if (backend->remove)
+		backend->remove(item);
+	menu_clear(item);
+	text_clear(item);
+	icon_free(&item->src);
+	free(item->service);
+	free(item->path);
+	free(item->id);
+	item->service = NULL;
+	item->path = NULL;
+	item->id = NULL;
+	item->priv = NULL;
+	dirty = 1;
+
+	props_changed(PropItems);
+}
+
+static DBusHandlerResult
+register_item(DBusConnection *connection, DBusMessage *msg)
+{
+	const char *service = NULL;
+	const char *path;
+	const char *sender;
+	DBusMessage *reply;
+
+	dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &service, DBUS_TYPE_INVALID);
+	sender = dbus_message_get_sender(msg);
+
+	if (service && service[0] == '/') {
+		path = service;
+		service = sender;
+	} else if (service && service[0] == ':') {
+		path = "/StatusNotifierItem";
+	} else {
+		path = "/StatusNotifierItem";
+		if (!service || service[0] == '\0')
+			service = sender;
+	}
+
+	add_item(service, path);
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply) {
+		out_send(reply);
+		dbus_message_unref(reply);
+	}
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult
+register_host(DBusConnection *connection, DBusMessage *msg)
+{
+	const char *service = NULL;
+	DBusMessage *reply;
+	int i;
+
+	/* Hosts register a well-known name; follow it to know when it goes */
+	dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &service, DBUS_TYPE_INVALID);
+	if (!service || service[0] == '\0' || service[0] == '/')
+		service = dbus_message_get_sender(msg);
+	for (i = 0; service && i < nhosts; i++)
+		if (strcmp(hosts[i], service) == 0)
+			service = NULL;
+	if (service && nhosts < MAX_HOSTS && (hosts[nhosts] = strdup(service)))
+		if (++nhosts == 1 && !host)
+			props_changed(PropHostRegistered);
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply) {
+		out_send(reply);
+		dbus_message_unref(reply);
+	}
+	out_signal(OutHostRegistered, NULL);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Send a copy of a prebuilt reply, addressed as a reply to msg */
+static DBusHandlerResult
+send_template(DBusConnection *connection, DBusMessage *msg, DBusMessage *tmpl)
+{
+	DBusMessage *reply;
+	const char *sender = dbus_message_get_sender(msg);
+
+	if (!tmpl || !(reply = dbus_message_copy(tmpl)))
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	dbus_message_set_reply_serial(reply, dbus_message_get_serial(msg));
+	if (sender)
+		dbus_message_set_destination(reply, sender);
+	out_send(reply);
+	dbus_message_unref(reply);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult
+get_property(DBusConnection *connection, DBusMessage *msg)
+{
+	const char *iface = NULL;
+	const char *prop = NULL;
+	DBusMessage *reply;
+	int id = -1;
+
+	if (dbus_message_get_args(msg, NULL,
+	    DBUS_TYPE_STRING, &iface,
+	    DBUS_TYPE_STRING, &prop,
+	    DBUS_TYPE_INVALID))
+		id = dispatch_prop(prop);
+	props_sync();
+	if (id >= 0)
+		return send_template(connection, msg, getreply[id]);
+
+	reply = dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_PROPERTY, "Unknown property");
+	if (!reply)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	out_send(reply);
+	dbus_message_unref(reply);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult
+get_all_properties(DBusConnection *connection, DBusMessage *msg)
+{
+	props_sync();
+	return send_template(connection, msg, getallreply);
+}
+
+static DBusHandlerResult
+handle_introspect(DBusConnection *connection, DBusMessage *msg)
+{
+	DBusMessage *reply;
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply) {
+		dbus_message_append_args(reply, DBUS_TYPE_STRING, &introspect_xml, DBUS_TYPE_INVALID);
+		out_send(reply);
+		dbus_message_unref(reply);
+	}
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult (*methodhandlers[MethodLast])(DBusConnection *, DBusMessage *) = {
+	[MethodRegisterItem] = register_item,
+	[MethodRegisterHost] = register_host,
+	[MethodGet] = get_property,
+	[MethodGetAll] = get_all_properties,
+	[MethodIntrospect] = handle_introspect,
+};
+
+static DBusHandlerResult
+message_handler(DBusConnection *connection, DBusMessage *msg, void *data)
+{
+	DBusHandlerResult ret;
+	int id;
+
+	if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	/* Some apps call without an interface; dispatch then matches any */
+	id = dispatch_method(dbus_message_get_interface(msg), dbus_message_get_member(msg));
+	if (id < 0)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	lag_enter(dispatch_methodname(id), NULL);
+	ret = methodhandlers[id](connection, msg);
+	lag_leave();
+	return ret;
+}
+
+static void
+remove_host(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nhosts; i++) {
+		if (strcmp(hosts[i], name) == 0) {
+			free(hosts[i]);
+			hosts[i] = hosts[--nhosts];
+			if (!nhosts && !host)
+				props_changed(PropHostRegistered);
+			return;
+		}
+	}
+}
+
+/* Handle NameOwnerChanged for cleanup */
+static void
+name_owner_changed(DBusMessage *msg)
+{
+	const char *name, *old_owner, *new_owner;
+
+	if (dbus_message_get_args(msg, NULL,
+	    DBUS_TYPE_STRING, &name,
+	    DBUS_TYPE_STRING, &old_owner,
+	    DBUS_TYPE_STRING, &new_owner,
+	    DBUS_TYPE_INVALID)) {
+		if (new_owner[0] == '\0') {
+			remove_item(name);
+			remove_host(name);
+			out_forget(name);
+		}
+	}
+}
+
+/* Handle NewIcon signal to refresh icon */
+static void
+new_icon(DBusMessage *msg)
+{
+	const char *sender = dbus_message_get_sender(msg);
+	Item *item;
+
+	if (host && sender && (item = find_item(sender)))
+		icon_changed(item);
+}
+
+/* NewStatus carries the new value; NewTitle has to be asked */
+static void
+new_status(DBusMessage *msg)
+{
+	const char *sender = dbus_message_get_sender(msg);
+	const char *status;
+	Item *item;
+
+	if (sender && (item = find_item(sender)) && dbus_message_get_args(msg, NULL,
+	    DBUS_TYPE_STRING, &status, DBUS_TYPE_INVALID))
+		text_set(item, TextStatus, status);
+}
+
+static void
+new_title(DBusMessage *msg)
+{
+	const char *sender = dbus_message_get_sender(msg);
+	Item *item;
+
+	if (sender && (item = find_item(sender)))
+		text_fetch(item, TextTitle);
+}
+
+/* Keep cached menus current */
+static void
+layout_updated(DBusMessage *msg)
+{
+	Item *item = find_item_by_menu(dbus_message_get_sender(msg), dbus_message_get_path(msg));
+	dbus_uint32_t revision;
+	int parent;
+
+	if (item && dbus_message_get_args(msg, NULL,
+	    DBUS_TYPE_UINT32, &revision,
+	    DBUS_TYPE_INT32, &parent,
+	    DBUS_TYPE_INVALID))
+		menu_fetch(item, parent);
+}
+
+static void
+items_properties_updated(DBusMessage *msg)
+{
+	Item *item = find_item_by_menu(dbus_message_get_sender(msg), dbus_message_get_path(msg));
+
+	if (item)
+		menu_props_updated(item, msg);
+}
+
+static void (*signalhandlers[SignalLast])(DBusMessage *) = {
+	[SignalNameOwnerChanged] = name_owner_changed,
+	[SignalNewIcon] = new_icon,
+	[SignalNewStatus] = new_status,
+	[SignalNewTitle] = new_title,
+	[SignalLayoutUpdated] = layout_updated,
+	[SignalItemsPropertiesUpdated] = items_properties_updated,
+};
+
+static DBusHandlerResult
+filter_handler(DBusConnection *connection, DBusMessage *msg, void *data)
+{
+	int id;
+
+	if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	id = dispatch_signal(dbus_message_get_interface(msg), dbus_message_get_member(msg));
+	if (id >= 0) {
+		lag_enter(dispatch_signalname(id), NULL);
+		signalhandlers[id](msg);
+		lag_leave();
+	}
+
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Sees everything before the handlers do, when recording */
+static DBusHandlerResult
+trace_handler(DBusConnection *connection, DBusMessage *msg, void *data)
+{
+	trace_in(msg);
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static DBusObjectPathVTable vtable = {
+	.message_function = message_handler
+};
+
+/* Take the watcher names and start serving. With host set the items
+ * are shown through b, else other hosts are expected to show them. */
+int
+watcher_setup(const Backend *b, int ishost)
+{
+	DBusError err;
+	int ret;
+
+	backend = b;
+	host = ishost;
+	dbus_error_init(&err);
+
+	conn = dbus_bus_get(DBUS_BUS_SESSION, &err);
+	if (dbus_error_is_set(&err)) {
+		fprintf(stderr, "dtray: dbus connection error: %s\n", err.message);
+		dbus_error_free(&err);
+		return 0;
+	}
+
+	/* Request the StatusNotifierWatcher names */
+	ret = dbus_bus_request_name(conn, "org.kde.StatusNotifierWatcher",
+		DBUS_NAME_FLAG_REPLACE_EXISTING, &err);
+	if (dbus_error_is_set(&err)) {
+		fprintf(stderr, "dtray: name request error: %s\n", err.message);
+		dbus_error_free(&err);
+		return 0;
+	}
+	if (ret != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+		fprintf(stderr, "dtray: could not become org.kde.StatusNotifierWatcher\n");
+		return 0;
+	}
+
+	ret = dbus_bus_request_name(conn, "org.freedesktop.StatusNotifierWatcher",
+		DBUS_NAME_FLAG_REPLACE_EXISTING, NULL);
+
+	out_setup(conn, WATCHER_PATH);
+	props_build(PROPS_ALL);
+	props_announce(PROPS_ALL);
+
+	/* Register object path handler */
+	if (!dbus_connection_register_object_path(conn, WATCHER_PATH, &vtable, NULL)) {
+		fprintf(stderr, "dtray: failed to register object path\n");
+		return 0;
+	}
+
+	if (cfg.shmpath)
+		exporting = shm_setup(cfg.shmpath, cfg.shmicons ? cfg.iconsrcmax : 0);
+	exporticons = exporting && cfg.shmicons;
+
+	/* Add filter for NameOwnerChanged, and NewIcon and menus if hosting */
+	if (trace_active())
+		dbus_connection_add_filter(conn, trace_handler, NULL, NULL);
+	dbus_connection_add_filter(conn, filter_handler, NULL, NULL);
+	dbus_bus_add_match(conn,
+		"type='signal',interface='org.freedesktop.DBus',member='NameOwnerChanged'",
+		NULL);
+	if (exporting) {
+		dbus_bus_add_match(conn,
+			"type='signal',interface='org.kde.StatusNotifierItem',member='NewStatus'",
+			NULL);
+		dbus_bus_add_match(conn,
+			"type='signal',interface='org.kde.StatusNotifierItem',member='NewTitle'",
+			NULL);
+	}
+	if (!host)
+		return 1;
+	dbus_bus_add_match(conn,
+		"type='signal',interface='org.kde.StatusNotifierItem',member='NewIcon'",
+		NULL);
+	dbus_bus_add_match(conn,
+		"type='signal',interface='com.canonical.dbusmenu'",
+		NULL);
+
+	return 1;
+}
+
+int
+watcher_fd(void)
+{
+	int fd = -1;
+
+	if (!conn || !dbus_connection_get_unix_fd(conn, &fd))
+		return -1;
+	return fd;
+}
+
+/* Handle queued messages and send what is due. Returns the number of
+ * milliseconds until the next deferred send, or -1 if none is pending. */
+int
+watcher_dispatch(void)
+{
+	int wait;
+
+	/* Coalesce a burst of wheel events into one call per tick */
+	wait = flush_scroll();
+
+	while (dbus_connection_dispatch(conn) == DBUS_DISPATCH_DATA_REMAINS)
+		;
+
+	/* Everything this iteration changed goes out once */
+	props_flush();
+	out_flush();
+	if (dirty) {
+		dirty = 0;
+		shm_publish();
+	}
+
+	watcher_read();
+	/* Writing may have read messages that are now waiting */
+	if (dbus_connection_get_dispatch_status(conn) == DBUS_DISPATCH_DATA_REMAINS)
+		wait = 0;
+	return wait;
+}
+
+/* Returns 1 if unsent messages wait for the socket to take them */
+int
+watcher_writing(void)
+{
+	return dbus_connection_has_messages_to_send(conn);
+}
+
+/* Move data in both directions without blocking. libdbus writes a
+ * little per call, so keep going while the socket takes it. */
+void
+watcher_read(void)
+{
+	long left;
+
+	do {
+		left = dbus_connection_get_outgoing_size(conn);
+		dbus_connection_read_write(conn, 0);
+	} while (dbus_connection_has_messages_to_send(conn) &&
+	         dbus_connection_get_outgoing_size(conn) < left);
+	out_flush();
+}
+
+void
+watcher_dump(FILE *fp)
+{
+	static const char *states[] = { "closed", "open", "half-open" };
+	long long now = now_ms();
+	Health *h;
+	int i;
+
+	fprintf(fp, "dtray: %d item slots, %d other hosts, %s backend\n",
+		nitems, nhosts, backend->name);
+	for (i = 0; i < nitems; i++) {
+		if (!items[i].service)
+			continue;
+		h = &items[i].health;
+		fprintf(fp, "dtray:   %s%s breaker=%s", items[i].service,
+			items[i].path, states[h->state]);
+		if (h->state == BreakerOpen)
+			fprintf(fp, " (retry in %lldms)", h->retry > now ? h->retry - now : 0);
+		fprintf(fp, " latency=%dms timeout=%dms ok=%u fail=%u",
+			h->latency, health_timeout(h), h->nok, h->nfail);
+		if (items[i].text[TextStatus])
+			fprintf(fp, " status=%s", items[i].text[TextStatus]);
+		fputc('\n', fp);
+	}
+	if (backend == &nullbackend)
+		null_dump(fp);
+	out_dump(fp);
+	lag_dump(fp);
+}
+
+void
+watcher_cleanup(void)
+{
+	int i;
+
+	shm_cleanup();
+	exporting = 0;
+	for (i = 0; i < nitems; i++) {
+		if (items[i].service && backend->remove)
+			backend->remove(&items[i]);
+		menu_clear(&items[i]);
+		text_clear(&items[i]);
+		free(items[i].service);
+		free(items[i].path);
+		free(items[i].id);
+		icon_free(&items[i].src);
+		memset(&items[i], 0, sizeof(items[i]));
+	}
+	nitems = 0;
+	for (i = 0; i < nhosts; i++)
+		free(hosts[i]);
+	nhosts = 0;
+	props_free();
+	out_cleanup();
+	if (conn)
+		dbus_connection_unref(conn);
+	conn = NULL;
+}
@@ -0,0 +1,1067 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * X11 backend: docks each item as an XEMBED window in the system tray
+ * and draws dbusmenu popups itself.
+ */
+
+#include <locale.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dbus/dbus.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+
+#include "icon.h"
+#include "dtray.h"
+#include "trace.h"
+#include "util.h"
+
+#define MAX_VARIANTS 3 /* scaled pixmaps kept per item */
+#define MENU_PAD 3
+#define MENU_SEP 7
+#define SYSTEM_TRAY_REQUEST_DOCK 0
+
+enum { ColFg, ColBg, ColSelFg, ColSelBg, ColDisFg, ColLast };
+enum { NetSystemTray, NetSystemTrayOpcode };
+
+/* The icon rendered for one window size */
+typedef struct {
+	int size;      /* window size it was made for, 0 if unused */
+	Pixmap pixmap;
+	int w, h;
+	unsigned int used; /* LRU stamp */
+} Variant;
+
+/* Per-item state, hung off Item.priv. Without a tray there is no
+ * window, GC or pixmap; they are made when a tray appears. */
+typedef struct {
+	Window win;     /* 0 while undocked */
+	GC gc;
+	int size;       /* current window size */
+	int asked;      /* iconsize the window was created with */
+	Variant variants[MAX_VARIANTS];
+	Variant *cur;   /* variant for the current size, NULL if none */
+} Dock;
+
+typedef struct {
+	Window win;
+	int id;   /* node whose children are shown */
+	int x, y, w, h;
+	int sel;  /* highlighted child index, -1 if none */
+} Popup;
+
+static Display *dpy;
+static int screen;
+static Window root;
+static Window tray;
+static Window last_tray;
+static Visual *visual;
+static int depth;
+static Colormap colormap;
+static XColor bg;
+static int bgalloc;    /* bg.pixel was allocated, so reload frees it */
+static Format format;
+static Convert convert;
+static unsigned int variantclock;
+static Atom netatom[2];
+static XFontSet menufs;   /* labels are UTF-8 */
+static int menuascent, menuheight;
+static unsigned long menucol[ColLast];
+static int menualloc[ColLast];
+static GC menugc;
+static Popup popups[MENU_DEPTH];
+static int npopups;
+static int menuarmed;
+static Item *menuitem; /* item whose menu is open */
+
+static void render_icon(Item *item);
+static void update_variant(Item *item);
+static void free_variants(Dock *d);
+static void menu_close(void);
+static Window create_icon_window(GC *gc_out, int size);
+
+static int
+xerror(Display *dpy, XErrorEvent *ee)
+{
+	/* Ignore X errors during redocking */
+	return 0;
+}
+
+static int
+xioerror(Display *dpy)
+{
+	/* X connection broken - exit cleanly */
+	running = 0;
+	return 0;
+}
+
+static Window
+get_tray(void)
+{
+	char atom_name[64];
+	Atom selection;
+	Window owner;
+
+	snprintf(atom_name, sizeof(atom_name), "_NET_SYSTEM_TRAY_S%d", screen);
+	selection = XInternAtom(dpy, atom_name, False);
+	owner = XGetSelectionOwner(dpy, selection);
+	return owner;
+}
+
+static void
+send_tray_message(Window w, long message, long data1, long data2, long data3)
+{
+	XEvent ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.xclient.type = ClientMessage;
+	ev.xclient.window = tray;
+	ev.xclient.message_type = netatom[NetSystemTrayOpcode];
+	ev.xclient.format = 32;
+	ev.xclient.data.l[0] = CurrentTime;
+	ev.xclient.data.l[1] = message;
+	ev.xclient.data.l[2] = w;
+	ev.xclient.data.l[3] = data1;
+	ev.xclient.data.l[4] = data2;
+
+	XSendEvent(dpy, tray, False, NoEventMask, &ev);
+}
+
+/* Create the item's window and ask the tray to embed it; the caller
+ * syncs, so a batch costs one round trip */
+static void
+dock(Item *item)
+{
+	Dock *d = item->priv;
+
+	d->win = create_icon_window(&d->gc, d->size);
+	send_tray_message(d->win, SYSTEM_TRAY_REQUEST_DOCK, 0, 0, 0);
+	XMapWindow(dpy, d->win);
+}
+
+/* Give up the item's X resources, keeping its source pixels */
+static void
+undock(Item *item)
+{
+	Dock *d = item->priv;
+
+	if (menuitem == item)
+		menu_close();
+	free_variants(d);
+	if (d->gc)
+		XFreeGC(dpy, d->gc);
+	if (d->win)
+		XDestroyWindow(dpy, d->win);
+	d->gc = 0;
+	d->win = 0;
+}
+
+/* A tray appeared: dock every item in one batch, replacing windows
+ * the previous tray had, then draw them, fetching only pixels that
+ * changed while nothing showed them */
+static void
+redock_all(void)
+{
+	Dock *d;
+	int i;
+	struct timespec ts = { 0, 100000000 }; /* 100ms */
+
+	tray = get_tray();
+	if (!tray)
+		return;
+
+	lag_enter("redock", NULL);
+	/* Wait for systray to be ready */
+	nanosleep(&ts, NULL);
+
+	for (i = 0; i < nitems; i++) {
+		if ((d = items[i].priv)) {
+			if (d->win)
+				undock(&items[i]);
+			dock(&items[i]);
+		}
+	}
+	XSync(dpy, False);
+
+	for (i = 0; i < nitems; i++) {
+		if (!items[i].priv)
+			continue;
+		if (items[i].iconstale)
+			fetch_icon(&items[i]);
+		update_variant(&items[i]);
+		render_icon(&items[i]);
+	}
+	last_tray = tray;
+	lag_leave();
+}
+
+static Item *
+find_item_by_window(Window w)
+{
+	Dock *d;
+	int i;
+	for (i = 0; i < nitems; i++) {
+		if ((d = items[i].priv) && d->win == w)
+			return &items[i];
+	}
+	return NULL;
+}
+
+static void
+render_icon(Item *item)
+{
+	Dock *d = item->priv;
+	Variant *v;
+
+	if (!d || !d->cur || !d->win)
+		return;
+
+	v = d->cur;
+	int dst_x = (d->size - v->w) / 2;
+	int dst_y = (d->size - v->h) / 2;
+	if (dst_x < 0) dst_x = 0;
+	if (dst_y < 0) dst_y = 0;
+
+	XClearWindow(dpy, d->win);
+	XCopyArea(dpy, v->pixmap, d->win, d->gc,
+		0, 0, v->w, v->h, dst_x, dst_y);
+	XFlush(dpy);
+}
+
+/* Composite premultiplied pixels over the background into a pixmap,
+ * with the kernel chosen for the visual at startup */
+static Pixmap
+make_pixmap(GC gc, const Image *icon)
+{
+	XImage *img;
+	Pixmap pm;
+	uint32_t bgrgb;
+	int y;
+
+	if (!convert)
+		return 0;
+	img = XCreateImage(dpy, visual, depth, ZPixmap, 0,
+		NULL, icon->w, icon->h, 32, 0);
+	if (!img)
+		return 0;
+	if (!(img->data = malloc((size_t)img->bytes_per_line * icon->h))) {
+		XDestroyImage(img);
+		return 0;
+	}
+
+	bgrgb = (bg.red >> 8) << 16 | (bg.green >> 8) << 8 | bg.blue >> 8;
+	for (y = 0; y < icon->h; y++)
+		convert(&format, (unsigned char *)img->data + (size_t)y * img->bytes_per_line,
+			icon->px + (size_t)y * icon->w, icon->w, bgrgb);
+
+	pm = XCreatePixmap(dpy, root, icon->w, icon->h, depth);
+	XPutImage(dpy, pm, gc, img, 0, 0, 0, 0, icon->w, icon->h);
+	XDestroyImage(img);
+	return pm;
+}
+
+static void
+free_variants(Dock *d)
+{
+	int i;
+
+	for (i = 0; i < MAX_VARIANTS; i++) {
+		if (d->variants[i].pixmap)
+			XFreePixmap(dpy, d->variants[i].pixmap);
+		memset(&d->variants[i], 0, sizeof(Variant));
+	}
+	d->cur = NULL;
+}
+
+/* Point the dock at a variant for its size, rescaling the retained
+ * source locally if none is cached. Never talks to the app. */
+static void
+update_variant(Item *item)
+{
+	Dock *d = item->priv;
+	Variant *v, *lru = NULL;
+	Image scaled;
+	int i, size = d->size, inner;
+
+	/* Nothing to draw into before the item is docked */
+	if (!item->src.px || size < 1 || !d->win)
+		return;
+
+	for (i = 0; i < MAX_VARIANTS; i++) {
+		v = &d->variants[i];
+		if (v->size == size) {
+			v->used = ++variantclock;
+			d->cur = v;
+			return;
+		}
+		if (!lru || v->used < lru->used)
+			lru = v;
+	}
+
+	inner = size - 2 * cfg.iconpadding;
+	if (!icon_scale(&scaled, &item->src, inner > 0 ? inner : 1))
+		return;
+	if (lru->pixmap)
+		XFreePixmap(dpy, lru->pixmap);
+	memset(lru, 0, sizeof(*lru));
+	if ((lru->pixmap = make_pixmap(d->gc, &scaled))) {
+		lru->size = size;
+		lru->w = scaled.w;
+		lru->h = scaled.h;
+		lru->used = ++variantclock;
+		d->cur = lru;
+	} else if (d->cur == lru) {
+		d->cur = NULL;
+	}
+	icon_free(&scaled);
+}
+
+static void
+resize_item(Item *item, int size)
+{
+	Dock *d = item->priv;
+
+	if (size == d->size)
+		return;
+	d->size = size;
+	update_variant(item);
+	render_icon(item);
+}
+
+static int
+menu_rowh(void)
+{
+	return menuheight + 2 * MENU_PAD;
+}
+
+static int
+menu_childh(MenuNode *c)
+{
+	return !c->visible ? 0 : c->separator ? MENU_SEP : menu_rowh();
+}
+
+static int
+menu_visible(MenuNode *n)
+{
+	int i;
+
+	for (i = 0; n && i < n->nchildren; i++)
+		if (n->children[i]->visible)
+			return 1;
+	return 0;
+}
+
+/* Size a popup to the children of its node */
+static void
+popup_size(Popup *p, MenuNode *n)
+{
+	MenuNode *c;
+	XRectangle r;
+	int i;
+
+	p->w = 0;
+	p->h = 0;
+	for (i = 0; i < n->nchildren; i++) {
+		c = n->children[i];
+		p->h += menu_childh(c);
+		if (c->visible && c->label) {
+			Xutf8TextExtents(menufs, c->label, strlen(c->label), NULL, &r);
+			if (r.width > p->w)
+				p->w = r.width;
+		}
+	}
+	/* Gutters for the toggle indicator and the submenu arrow */
+	p->w += 2 * menu_rowh();
+	if (p->h < 1)
+		p->h = 1;
+}
+
+/* Keep a popup on screen; alt is the x to right-align to if it won't fit */
+static void
+popup_place(Popup *p, int x, int y, int alt)
+{
+	int sw = DisplayWidth(dpy, screen);
+	int sh = DisplayHeight(dpy, screen);
+
+	if (x + p->w > sw)
+		x = alt - p->w;
+	if (x + p->w > sw)
+		x = sw - p->w;
+	if (y + p->h > sh)
+		y = sh - p->h;
+	p->x = x < 0 ? 0 : x;
+	p->y = y < 0 ? 0 : y;
+}
+
+/* Index of the selectable child at y, or -1 */
+static int
+popup_hit(Popup *p, MenuNode *n, int y)
+{
+	int i, top = 0, h;
+
+	for (i = 0; i < n->nchildren; i++) {
+		h = menu_childh(n->children[i]);
+		if (y >= top && y < top + h)
+			return n->children[i]->separator ? -1 : i;
+		top += h;
+	}
+	return -1;
+}
+
+static int
+popup_rowy(MenuNode *n, int idx)
+{
+	int i, y = 0;
+
+	for (i = 0; i < idx && i < n->nchildren; i++)
+		y += menu_childh(n->children[i]);
+	return y;
+}
+
+static void
+popup_draw(Popup *p)
+{
+	MenuNode *n, *c;
+	XPoint arrow[3];
+	int i, y = 0, rowh, b, bx, by, sel;
+
+	if (!(n = menu_find(menuitem->layout, p->id)))
+		return;
+	rowh = menu_rowh();
+	b = rowh / 2;
+	bx = (rowh - b) / 2;
+
+	XSetForeground(dpy, menugc, menucol[ColBg]);
+	XFillRectangle(dpy, p->win, menugc, 0, 0, p->w, p->h);
+	for (i = 0; i < n->nchildren; i++) {
+		c = n->children[i];
+		if (!c->visible)
+			continue;
+		if (c->separator) {
+			XSetForeground(dpy, menugc, menucol[ColDisFg]);
+			XDrawLine(dpy, p->win, menugc, MENU_PAD, y + MENU_SEP / 2,
+				p->w - MENU_PAD, y + MENU_SEP / 2);
+			y += MENU_SEP;
+			continue;
+		}
+
+		sel = i == p->sel && c->enabled;
+		if (sel) {
+			XSetForeground(dpy, menugc, menucol[ColSelBg]);
+			XFillRectangle(dpy, p->win, menugc, 0, y, p->w, rowh);
+		}
+		XSetForeground(dpy, menugc,
+			menucol[!c->enabled ? ColDisFg : sel ? ColSelFg : ColFg]);
+
+		by = y + (rowh - b) / 2;
+		if (c->toggle == ToggleCheck) {
+			if (c->toggled)
+				XFillRectangle(dpy, p->win, menugc, bx, by, b, b);
+			else
+				XDrawRectangle(dpy, p->win, menugc, bx, by, b - 1, b - 1);
+		} else if (c->toggle == ToggleRadio) {
+			if (c->toggled)
+				XFillArc(dpy, p->win, menugc, bx, by, b, b, 0, 360 * 64);
+			else
+				XDrawArc(dpy, p->win, menugc, bx, by, b - 1, b - 1, 0, 360 * 64);
+		}
+		if (c->label)
+			Xutf8DrawString(dpy, p->win, menufs, menugc, rowh,
+				y + MENU_PAD + menuascent, c->label, strlen(c->label));
+		if (c->nchildren || c->submenu) {
+			arrow[0].x = p->w - rowh + bx;
+			arrow[0].y = by;
+			arrow[1].x = arrow[0].x;
+			arrow[1].y = by + b;
+			arrow[2].x = arrow[0].x + b / 2;
+			arrow[2].y = by + b / 2;
+			XFillPolygon(dpy, p->win, menugc, arrow, 3, Convex, CoordModeOrigin);
+		}
+		y += rowh;
+	}
+}
+
+static void
+popup_open(int id, int x, int y, int alt)
+{
+	XSetWindowAttributes wa;
+	Popup *p;
+	MenuNode *n;
+
+	if (npopups >= MENU_DEPTH || !(n = menu_find(menuitem->layout, id)))
+		return;
+
+	p = &popups[npopups];
+	p->id = id;
+	p->sel = -1;
+	popup_size(p, n);
+	popup_place(p, x, y, alt);
+
+	wa.override_redirect = True;
+	wa.save_under = True;
+	wa.background_pixel = menucol[ColBg];
+	wa.event_mask = ExposureMask | ButtonPressMask | ButtonReleaseMask |
+		PointerMotionMask | KeyPressMask;
+	p->win = XCreateWindow(dpy, root, p->x, p->y, p->w, p->h, 0,
+		CopyFromParent, InputOutput, CopyFromParent,
+		CWOverrideRedirect | CWSaveUnder | CWBackPixel | CWEventMask, &wa);
+	XMapRaised(dpy, p->win);
+	npopups++;
+}
+
+/* Close every popup deeper than level */
+static void
+popup_close_from(int level)
+{
+	while (npopups > level)
+		XDestroyWindow(dpy, popups[--npopups].win);
+}
+
+/* Open the submenu of the selected child of popup level, if it has one.
+ * notify sends AboutToShow, which refreshes must not do or an app that
+ * answers it with LayoutUpdated would loop. */
+static void
+popup_submenu(int level, int notify)
+{
+	Popup *p = &popups[level];
+	MenuNode *n, *c;
+
+	popup_close_from(level + 1);
+	if (p->sel < 0 || !(n = menu_find(menuitem->layout, p->id)) || p->sel >= n->nchildren)
+		return;
+	c = n->children[p->sel];
+	if (!c->enabled || !(c->nchildren || c->submenu))
+		return;
+	if (notify)
+		menu_notify(menuitem, c->id, NULL, CurrentTime);
+	if (menu_visible(c))
+		popup_open(c->id, p->x + p->w, p->y + popup_rowy(n, p->sel), p->x);
+}
+
+static void
+menu_close(void)
+{
+	if (!menuitem)
+		return;
+	popup_close_from(0);
+	XUngrabPointer(dpy, CurrentTime);
+	XUngrabKeyboard(dpy, CurrentTime);
+	XFlush(dpy);
+	if (menuitem->layout)
+		menu_notify(menuitem, menuitem->layout->id, "closed", CurrentTime);
+	menuitem = NULL;
+}
+
+/* The cached layout changed under open popups: re-resolve them by id */
+static void
+menu_refresh(void)
+{
+	MenuNode *n;
+	Popup *p;
+	int i;
+
+	for (i = 0; i < npopups; i++) {
+		p = &popups[i];
+		if (!(n = menu_find(menuitem->layout, p->id)) || !menu_visible(n)) {
+			if (i == 0) {
+				menu_close();
+				return;
+			}
+			popup_close_from(i);
+			break;
+		}
+		if (p->sel >= n->nchildren)
+			p->sel = -1;
+		popup_size(p, n);
+		popup_place(p, p->x, p->y, p->x);
+		XMoveResizeWindow(dpy, p->win, p->x, p->y, p->w, p->h);
+		popup_draw(p);
+	}
+	/* A lazily populated submenu may have just arrived */
+	if (npopups && popups[npopups - 1].sel >= 0)
+		popup_submenu(npopups - 1, 0);
+	XFlush(dpy);
+}
+
+/* Show the cached menu at x, y; returns 0 if there is nothing to show */
+static int
+menu_open(Item *item, int x, int y)
+{
+	if (!menufs || !item->layout || !menu_visible(item->layout))
+		return 0;
+
+	menu_close();
+	menuitem = item;
+	menuarmed = 0;
+	popup_open(item->layout->id, x, y, x);
+	if (!npopups) {
+		menuitem = NULL;
+		return 0;
+	}
+	XGrabPointer(dpy, popups[0].win, True,
+		ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
+		GrabModeAsync, GrabModeAsync, None, None, CurrentTime);
+	XGrabKeyboard(dpy, popups[0].win, True, GrabModeAsync, GrabModeAsync, CurrentTime);
+	XFlush(dpy);
+
+	menu_notify(menuitem, item->layout->id, NULL, CurrentTime);
+	menu_notify(menuitem, item->layout->id, "opened", CurrentTime);
+	return 1;
+}
+
+/* Deepest popup under the root coordinates, or -1 */
+static int
+popup_at(int x, int y)
+{
+	int i;
+
+	for (i = npopups - 1; i >= 0; i--)
+		if (x >= popups[i].x && x < popups[i].x + popups[i].w &&
+		    y >= popups[i].y && y < popups[i].y + popups[i].h)
+			return i;
+	return -1;
+}
+
+/* Handle events while a menu is open; returns 1 if consumed */
+static int
+menu_xevent(XEvent *ev)
+{
+	MenuNode *n;
+	Popup *p;
+	int i, sel;
+
+	if (!menuitem)
+		return 0;
+
+	switch (ev->type) {
+	case Expose:
+		for (i = 0; i < npopups; i++) {
+			if (popups[i].win == ev->xexpose.window) {
+				if (ev->xexpose.count == 0)
+					popup_draw(&popups[i]);
+				return 1;
+			}
+		}
+		return 0;
+	case MotionNotify:
+		if ((i = popup_at(ev->xmotion.x_root, ev->xmotion.y_root)) < 0)
+			return 1;
+		p = &popups[i];
+		if (!(n = menu_find(menuitem->layout, p->id)))
+			return 1;
+		sel = popup_hit(p, n, ev->xmotion.y_root - p->y);
+		if (sel != p->sel) {
+			p->sel = sel;
+			popup_draw(p);
+			popup_submenu(i, 1);
+		}
+		menuarmed = 1;
+		return 1;
+	case ButtonPress:
+		/* Presses outside dismiss; selection happens on release */
+		if (popup_at(ev->xbutton.x_root, ev->xbutton.y_root) < 0)
+			menu_close();
+		return 1;
+	case ButtonRelease:
+		/* The release of the click that opened the menu selects nothing */
+		if (!menuarmed) {
+			menuarmed = 1;
+			return 1;
+		}
+		if ((i = popup_at(ev->xbutton.x_root, ev->xbutton.y_root)) < 0)
+			return 1;
+		p = &popups[i];
+		if (!(n = menu_find(menuitem->layout, p->id)))
+			return 1;
+		sel = popup_hit(p, n, ev->xbutton.y_root - p->y);
+		if (sel < 0 || !n->children[sel]->enabled ||
+		    n->children[sel]->nchildren || n->children[sel]->submenu)
+			return 1;
+		trace_x(XMenuClick, 0, n->children[sel]->id, 0, menuitem->id);
+		menu_notify(menuitem, n->children[sel]->id, "clicked", ev->xbutton.time);
+		menu_close();
+		return 1;
+	case KeyPress:
+		if (XLookupKeysym(&ev->xkey, 0) == XK_Escape)
+			menu_close();
+		return 1;
+	}
+	return 0;
+}
+
+static void
+menu_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < ColLast; i++)
+		if (menualloc[i])
+			XFreeColors(dpy, colormap, &menucol[i], 1, 0);
+	memset(menualloc, 0, sizeof(menualloc));
+	if (menufs)
+		XFreeFontSet(dpy, menufs);
+	if (menugc)
+		XFreeGC(dpy, menugc);
+	menufs = NULL;
+	menugc = 0;
+}
+
+static XFontSet
+menu_fontset(const char *name)
+{
+	XFontSet fs;
+	char **missing, *def;
+	int nmissing;
+
+	fs = XCreateFontSet(dpy, name, &missing, &nmissing, &def);
+	if (missing)
+		XFreeStringList(missing);
+	return fs;
+}
+
+static void
+menu_init(void)
+{
+	const char *names[ColLast];
+	XColor color;
+	XGCValues gcv;
+	XFontSetExtents *ext;
+	int i;
+
+	names[ColFg] = cfg.menufg;
+	names[ColBg] = cfg.menubg;
+	names[ColSelFg] = cfg.menuselfg;
+	names[ColSelBg] = cfg.menuselbg;
+	names[ColDisFg] = cfg.menudisfg;
+	for (i = 0; i < ColLast; i++) {
+		menualloc[i] = XParseColor(dpy, colormap, names[i], &color) &&
+			XAllocColor(dpy, colormap, &color);
+		if (!menualloc[i])
+			color.pixel = i == ColBg || i == ColSelBg ?
+				BlackPixel(dpy, screen) : WhitePixel(dpy, screen);
+		menucol[i] = color.pixel;
+	}
+
+	if (!(menufs = menu_fontset(cfg.menufont)) &&
+	    !(menufs = menu_fontset("fixed"))) {
+		fprintf(stderr, "dtray: cannot load menu font, using ContextMenu only\n");
+		return;
+	}
+	ext = XExtentsOfFontSet(menufs);
+	menuascent = -ext->max_logical_extent.y;
+	menuheight = ext->max_logical_extent.height;
+	gcv.graphics_exposures = False;
+	menugc = XCreateGC(dpy, root, GCGraphicsExposures, &gcv);
+}
+
+static Window
+create_icon_window(GC *gc_out, int size)
+{
+	Window win;
+	XSetWindowAttributes wa;
+	XGCValues gcv;
+
+	wa.background_pixel = bg.pixel;
+	wa.colormap = colormap;
+	wa.event_mask = ButtonPressMask | ButtonReleaseMask | ExposureMask |
+		StructureNotifyMask;
+	wa.override_redirect = False;
+
+	win = XCreateWindow(dpy, root, 0, 0, size, size, 0,
+		depth, InputOutput, visual,
+		CWBackPixel | CWColormap | CWEventMask | CWOverrideRedirect, &wa);
+
+	gcv.graphics_exposures = False;
+	*gc_out = XCreateGC(dpy, win, GCGraphicsExposures, &gcv);
+
+	return win;
+}
+
+/* Choose the pixel conversion kernel for the visual once */
+static void
+setup_format(void)
+{
+	XPixmapFormatValues *pf;
+	int i, n;
+
+	format.rmask = visual->red_mask;
+	format.gmask = visual->green_mask;
+	format.bmask = visual->blue_mask;
+	format.msb = ImageByteOrder(dpy) == MSBFirst;
+	if ((pf = XListPixmapFormats(dpy, &n))) {
+		for (i = 0; i < n; i++)
+			if (pf[i].depth == depth)
+				format.bpp = pf[i].bits_per_pixel;
+		XFree(pf);
+	}
+	if (!(convert = icon_converter(&format)))
+		fprintf(stderr, "dtray: unsupported visual (depth %d), icons disabled\n", depth);
+}
+
+static void
+handle_xevent(XEvent *ev)
+{
+	Item *item;
+	int x, y;
+	Window child;
+
+	if (menu_xevent(ev))
+		return;
+
+	switch (ev->type) {
+	case Expose:
+		if (ev->xexpose.count == 0) {
+			item = find_item_by_window(ev->xexpose.window);
+			if (item)
+				render_icon(item);
+		}
+		break;
+	case ConfigureNotify:
+		/* The tray resized us: rescale from the retained source */
+		item = find_item_by_window(ev->xconfigure.window);
+		if (!item)
+			break;
+		trace_x(XResize, 0, ev->xconfigure.width, ev->xconfigure.height, item->id);
+		resize_item(item, ev->xconfigure.width < ev->xconfigure.height ?
+			ev->xconfigure.width : ev->xconfigure.height);
+		break;
+	case ButtonPress:
+		item = find_item_by_window(ev->xbutton.window);
+		if (!item)
+			break;
+
+		XTranslateCoordinates(dpy, ev->xbutton.window, root,
+			ev->xbutton.x, ev->xbutton.y, &x, &y, &child);
+		trace_x(XPress, ev->xbutton.button, x, y, item->id);
+
+		switch (ev->xbutton.button) {
+		case 1:
+			activate_item(item, x, y);
+			break;
+		case 2:
+			secondary_activate(item, x, y);
+			break;
+		case 3:
+			/* Prefer the cached dbusmenu; ContextMenu is for apps without one */
+			if (!menu_open(item, x, y))
+				context_menu(item, x, y);
+			break;
+		/* Wheel: up is positive as SNI hosts send it (libappindicator
+		 * maps delta >= 0 to up); left is negative, right positive */
+		case 4:
+			item->scroll_dy++;
+			break;
+		case 5:
+			item->scroll_dy--;
+			break;
+		case 6:
+			item->scroll_dx--;
+			break;
+		case 7:
+			item->scroll_dx++;
+			break;
+		}
+		break;
+	}
+}
+
+static void
+setup_bg(void)
+{
+	if (bgalloc)
+		XFreeColors(dpy, colormap, &bg.pixel, 1, 0);
+	bgalloc = XParseColor(dpy, colormap, cfg.bgcolor, &bg) && XAllocColor(dpy, colormap, &bg);
+	if (!bgalloc) {
+		bg.pixel = BlackPixel(dpy, screen);
+		bg.red = bg.green = bg.blue = 0;
+	}
+}
+
+static int
+x11_init(void)
+{
+	/* Xutf8 calls convert labels to the locale's font charsets */
+	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
+		fprintf(stderr, "dtray: no locale support, menu labels may be garbled\n");
+	dpy = XOpenDisplay(NULL);
+	if (!dpy) {
+		fprintf(stderr, "dtray: cannot open display\n");
+		return 0;
+	}
+
+	screen = DefaultScreen(dpy);
+	root = RootWindow(dpy, screen);
+
+	/* Use default visual to match dwm's systray */
+	visual = DefaultVisual(dpy, screen);
+	depth = DefaultDepth(dpy, screen);
+	colormap = DefaultColormap(dpy, screen);
+	setup_bg();
+	setup_format();
+
+	XSetErrorHandler(xerror);
+	XSetIOErrorHandler(xioerror);
+
+	netatom[NetSystemTray] = XInternAtom(dpy, "_NET_SYSTEM_TRAY_S0", False);
+	netatom[NetSystemTrayOpcode] = XInternAtom(dpy, "_NET_SYSTEM_TRAY_OPCODE", False);
+
+	menu_init();
+	tray = last_tray = get_tray();
+	return 1;
+}
+
+static int
+x11_fd(void)
+{
+	return ConnectionNumber(dpy);
+}
+
+static void
+x11_process(void)
+{
+	XEvent ev;
+
+	while (XPending(dpy)) {
+		XNextEvent(dpy, &ev);
+		handle_xevent(&ev);
+	}
+}
+
+/* Check if systray owner changed (e.g., dwm restarted) */
+static void
+x11_tick(void)
+{
+	Window new_tray = get_tray();
+	Dock *d;
+	int i;
+
+	if (new_tray == last_tray)
+		return;
+	if (!new_tray) {
+		/* Tray gone: drop the windows so a new WM doesn't manage them,
+		 * and hold nothing on the server until a tray is back */
+		for (i = 0; i < nitems; i++)
+			if ((d = items[i].priv) && d->win)
+				undock(&items[i]);
+		XSync(dpy, False);
+		last_tray = tray = 0;
+	} else {
+		redock_all();
+	}
+}
+
+static void
+x11_add(Item *item)
+{
+	Dock *d;
+
+	if (!(item->priv = d = calloc(1, sizeof(Dock))))
+		return;
+	d->asked = d->size = cfg.iconsize;
+
+	/* Without a tray the item stays a record; x11_tick docks it later */
+	if (last_tray) {
+		dock(item);
+		XSync(dpy, False);
+	}
+}
+
+static void
+x11_remove(Item *item)
+{
+	if (menuitem == item)
+		menu_close();
+	if (!item->priv)
+		return;
+	undock(item);
+	free(item->priv);
+	item->priv = NULL;
+}
+
+static void
+x11_icon(Item *item)
+{
+	if (!item->priv)
+		return;
+	free_variants(item->priv);
+	update_variant(item);
+	render_icon(item);
+}
+
+static int
+x11_shown(Item *item)
+{
+	Dock *d = item->priv;
+
+	return d && d->win;
+}
+
+static void
+x11_menu(Item *item)
+{
+	if (menuitem == item)
+		menu_refresh();
+}
+
+/* Re-apply size, padding, background and menu look to the docked
+ * windows, rescaling from the retained source pixels */
+static void
+x11_reconfigure(void)
+{
+	Dock *d;
+	int i;
+
+	menu_close();
+	menu_cleanup();
+	menu_init();
+	setup_bg();
+
+	for (i = 0; i < nitems; i++) {
+		if (!(d = items[i].priv))
+			continue;
+		free_variants(d);
+		/* The tray may resize us again; ConfigureNotify follows it */
+		if (cfg.iconsize != d->asked) {
+			d->asked = d->size = cfg.iconsize;
+			if (d->win)
+				XResizeWindow(dpy, d->win, d->size, d->size);
+		}
+		if (!d->win)
+			continue;
+		XSetWindowBackground(dpy, d->win, bg.pixel);
+		update_variant(&items[i]);
+		XClearWindow(dpy, d->win);
+		render_icon(&items[i]);
+	}
+	XFlush(dpy);
+}
+
+static void
+x11_cleanup(void)
+{
+	if (!dpy)
+		return;
+	menu_cleanup();
+	XCloseDisplay(dpy);
+	dpy = NULL;
+}
+
+const Backend x11backend = {
+	.name = "x11",
+	.init = x11_init,
+	.fd = x11_fd,
+	.process = x11_process,
+	.tick = x11_tick,
+	.add = x11_add,
+	.remove = x11_remove,
+	.icon = x11_icon,
+	.shown = x11_shown,
+	.menu = x11_menu,
+	.reconfigure = x11_reconfigure,
+	.cleanup = x11_cleanup,
+};